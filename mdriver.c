@@ -20,6 +20,7 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 
 #include "memlib.h"
@@ -37,6 +38,15 @@
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
+/* Tuning of the size classes. Requests of TUNE_MAPPED bytes or more get
+   mapped regions by default and never reach the free lists. */
+#define TUNE_MAPPED (128 * 1024)
+#define TUNE_MIN_SINGULAR 4 /* singular classes kept at least */
+#define TUNE_HOT 64         /* sizes of 1/TUNE_HOT of requests are hot */
+#define TUNE_CHUNKS 5       /* chunk sizes tried, doubling from a page */
+#define TUNE_MIN_RATIO 1.25 /* narrowest class split, mm.c tells apart sizes
+                               in eight steps per doubling */
+
 /* weights */
 #define WNONE 0
 #define WALL 1
@@ -64,9 +74,11 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-  enum { ALLOC, FREE, REALLOC } type; /* type of request */
-  int index;                          /* index for free() to use later */
-  size_t size;                        /* byte size of alloc/realloc request */
+  enum { ALLOC, FREE, REALLOC, MEMALIGN, BATCH_ALLOC, BATCH_FREE } type;
+  int index;    /* index for free() to use later, the first one of a batch */
+  int count;    /* number of blocks of the request, consecutive indices */
+  size_t size;  /* byte size of alloc/realloc/memalign request */
+  size_t align; /* alignment of memalign request, a power of two */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -80,6 +92,7 @@ typedef struct {
   char **blocks;        /* array of ptrs returned by malloc/realloc... */
   size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
   int *block_rand_base; /* index into random_data, if debug is on */
+  void **batch;         /* blocks of a batch free, sorted by mm_free_batch */
 } trace_t;
 
 /*
@@ -102,6 +115,7 @@ typedef struct {
   /* run-time stats defined for both libc and student */
   int valid;   /* was the trace processed correctly by the allocator? */
   double secs; /* number of secs needed to run the trace */
+  long faults; /* number of page faults while the trace was timed */
 
   /* defined only for the student malloc package */
   double util; /* space utilization for this trace (always 0 for libc) */
@@ -111,6 +125,13 @@ typedef struct {
   /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+/* Counts the requests of one size in all traces */
+typedef struct {
+  size_t size;
+  int allocs; /* number of malloc and realloc requests of the size */
+  int frees;  /* number of blocks of the size given back to the allocator */
+} sizestat_t;
+
 /********************
  * For debugging.  If debug-mode is on, then we have each block start
  * at a "random" place (a hash of the index), and copy random data
@@ -162,7 +183,15 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int *used_p, int *total_p);
 static void eval_mm_speed(void *ptr);
 
+/* Routines for tuning the size classes of the mm malloc package */
+static sizestat_t *size_histogram(trace_t **traces, int num_traces,
+                                  int *num_sizes);
+static int tune_layout(const sizestat_t *sizes, int num_sizes, int max_singular,
+                       int max_classes, int *singular_p, size_t *limits);
+static void tune_classes(char **tracefiles, int num_traces);
+
 /* Various helper routines */
+static void printheader(void);
 static void printresults(stats_t *stats);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
@@ -192,6 +221,16 @@ static double fsecs(fsecs_test_funct f, void *argp) {
   return (1E-3 * diff);
 }
 
+/*
+ * page_faults - Return the number of page faults of the process so far
+ */
+static long page_faults(void) {
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt + usage.ru_majflt;
+}
+
 /* Run the tests; return the number of tests run (may be less than
    num_tracefiles, if there's a timeout) */
 static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
@@ -216,7 +255,9 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
     speed_params->ranges = ranges;
     if (verbose > 1)
       printf("and performance.\n");
+    mm_stats->faults = page_faults();
     mm_stats->secs = fsecs(eval_mm_speed, speed_params);
+    mm_stats->faults = page_faults() - mm_stats->faults;
   }
 
   free_trace(trace);
@@ -230,11 +271,15 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
  **************/
 int main(int argc, char **argv) {
   char *tracefile = NULL; /* trace file names */
+  char **tracefiles;      /* trace files given by -f and after the options */
+  int num_tracefiles = 0;
   range_t *ranges = NULL; /* keeps track of block extents for one trace */
   stats_t libc_stats;     /* libc stats for trace */
   stats_t mm_stats;       /* mm (i.e. student) stats for trace */
   speed_t speed_params;   /* input parameters to the xx_speed routines */
   int run_libc = 0;       /* If set, run libc malloc (set by -l) */
+  int tune = 0;           /* If set, tune the size classes (set by -T) */
+  int backend = MEM_SIMULATED; /* Backend of the heap (set by -b and -H) */
 
   setbuf(stdout, 0);
   setbuf(stderr, 0);
@@ -243,7 +288,7 @@ int main(int argc, char **argv) {
    * Read and interpret the command line arguments
    */
   char c;
-  while ((c = getopt(argc, argv, "d:f:v:hVlD")) != EOF) {
+  while ((c = getopt(argc, argv, "b:d:f:v:hHVlDT")) != EOF) {
     switch (c) {
       case 'f': /* Use one specific trace file only (relative to curr dir) */
         tracefile = strdup(optarg);
@@ -253,6 +298,10 @@ int main(int argc, char **argv) {
         run_libc = 1;
         break;
 
+      case 'T': /* Tune the size classes to the traces */
+        tune = 1;
+        break;
+
       case 'V': /* Increase verbosity level */
         verbose += 1;
         break;
@@ -261,6 +310,14 @@ int main(int argc, char **argv) {
         verbose = atoi(optarg);
         break;
 
+      case 'b': /* Choose the backend of the heap */
+        backend = atoi(optarg);
+        break;
+
+      case 'H': /* Back the heap by transparent huge pages */
+        backend |= MEM_HUGE;
+        break;
+
       case 'd':
         debug_mode = atoi(optarg);
         break;
@@ -279,7 +336,15 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (tracefile == NULL) {
+  mem_set_backend(backend);
+
+  tracefiles = calloc(argc - optind + 1, sizeof(char *));
+  if (tracefile != NULL)
+    tracefiles[num_tracefiles++] = tracefile;
+  while (optind < argc)
+    tracefiles[num_tracefiles++] = argv[optind++];
+
+  if (num_tracefiles == 0) {
     usage();
     exit(EXIT_FAILURE);
   }
@@ -287,6 +352,11 @@ int main(int argc, char **argv) {
   if (debug_mode != DBG_NONE)
     init_random_data();
 
+  if (tune) {
+    tune_classes(tracefiles, num_tracefiles);
+    return EXIT_SUCCESS;
+  }
+
   if (run_libc) {
     /*
      * Run and evaluate the libc malloc package
@@ -295,7 +365,7 @@ int main(int argc, char **argv) {
       printf("\nTesting libc malloc\n");
 
     /* Evaluate the libc malloc package using the K-best scheme */
-    trace_t *trace = read_trace(&libc_stats, tracefile);
+    trace_t *trace = read_trace(&libc_stats, tracefiles[0]);
 
     libc_stats.valid = eval_libc_valid(trace);
     if (libc_stats.valid) {
@@ -307,6 +377,7 @@ int main(int argc, char **argv) {
     /* Display the libc results in a compact table */
     if (verbose) {
       printf("\nResults for libc malloc:\n");
+      printheader();
       printresults(&libc_stats);
     }
 
@@ -319,16 +390,43 @@ int main(int argc, char **argv) {
   if (verbose > 1)
     printf("\nTesting mm malloc\n");
 
-  /* Allocate the mm stats array, with one stats_t struct per tracefile */
-  run_tests(tracefile, &mm_stats, ranges, &speed_params);
+  /* Totals over all traces, for the summary of more than one trace */
+  double util = 0.0, ops = 0.0, secs = 0.0;
+  long faults = 0;
+  int valid = 1;
 
-  /* Display the mm results */
   if (verbose) {
     printf("\nResults for mm malloc:\n");
-    printresults(&mm_stats);
+    printheader();
+  }
+
+  for (int i = 0; i < num_tracefiles; i++) {
+    run_tests(tracefiles[i], &mm_stats, ranges, &speed_params);
+
+    /* Display the mm results */
+    if (verbose)
+      printresults(&mm_stats);
+
+    valid &= mm_stats.valid;
+    if (mm_stats.valid) {
+      util += mm_stats.util;
+      ops += mm_stats.ops;
+      secs += mm_stats.secs;
+      faults += mm_stats.faults;
+    }
+  }
+
+  /* Average utilization and throughput of all traces */
+  if (num_tracefiles > 1) {
+    if (valid)
+      printf("util %5.1f%%  ops %8.0f  secs %9.6f  Kops %6.0f  faults %6ld\n",
+             util / num_tracefiles * 100.0, ops, secs, ops / 1e3 / secs,
+             faults);
+    else
+      printf("some traces are not valid\n");
   }
 
-  return mm_stats.valid ? EXIT_SUCCESS : EXIT_FAILURE;
+  return valid ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 /*****************************************************************
@@ -356,9 +454,11 @@ static int add_range(range_t **ranges, char *lo, int size, const trace_t *trace,
     return 0;
   }
 
-  /* The payload must lie within the extent of the heap */
-  if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-      (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+  /* The payload must lie within the extent of the heap or of a region
+     mapped by the allocator */
+  if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+       (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+      !mem_is_mapped(lo, hi)) {
     malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)", lo,
                  hi, mem_heap_lo(), mem_heap_hi());
     return 0;
@@ -531,14 +631,21 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
           calloc(trace->num_ids, sizeof(*trace->block_rand_base))))
     unix_error("malloc 5 failed in read_trace");
 
+  /* a batch frees at most all the blocks */
+  if (!(trace->batch = malloc(trace->num_ids * sizeof(void *))))
+    unix_error("malloc 6 failed in read_trace");
+
   /* read every request line in the trace file */
   int index = 0;
   int op_index = 0;
   int max_index = 0;
   char type[MAXLINE];
   int size;
+  unsigned align;
+  int count;
 
   while (fscanf(tracefile, "%s", type) != EOF) {
+    trace->ops[op_index].count = 1;
     switch (type[0]) {
       case 'a':
         ignore += fscanf(tracefile, "%u %u", &index, &size);
@@ -556,12 +663,44 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
         max_index = (index > max_index) ? index : max_index;
         break;
 
+      case 'm':
+        ignore += fscanf(tracefile, "%u %u %u", &index, &size, &align);
+        if (align == 0 || (align & (align - 1)))
+          app_error("%s: alignment %u is not a power of two", trace->filename,
+                    align);
+        trace->ops[op_index].type = MEMALIGN;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].size = size;
+        trace->ops[op_index].align = align;
+        max_index = (index > max_index) ? index : max_index;
+        break;
+
       case 'f':
         ignore += fscanf(tracefile, "%ud", &index);
         trace->ops[op_index].type = FREE;
         trace->ops[op_index].index = index;
         break;
 
+      case 'b': /* "ba <id> <count> <size>" and "bf <id> <count>" */
+        if (type[1] == 'a') {
+          ignore += fscanf(tracefile, "%u %u %u", &index, &count, &size);
+          trace->ops[op_index].type = BATCH_ALLOC;
+          trace->ops[op_index].size = size;
+        } else if (type[1] == 'f') {
+          ignore += fscanf(tracefile, "%u %u", &index, &count);
+          trace->ops[op_index].type = BATCH_FREE;
+        } else {
+          app_error("Bogus type (%s) in tracefile %s\n", type,
+                    trace->filename);
+        }
+        if (count <= 0)
+          app_error("%s: batch of %d blocks", trace->filename, count);
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].count = count;
+        index += count - 1;
+        max_index = (index > max_index) ? index : max_index;
+        break;
+
       default:
         app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                   trace->filename);
@@ -593,7 +732,7 @@ static void reinit_trace(trace_t *trace) {
 }
 
 /*
- * free_trace - Free the trace record and the four arrays it points
+ * free_trace - Free the trace record and the five arrays it points
  *              to, all of which were allocated in read_trace().
  */
 static void free_trace(trace_t *trace) {
@@ -601,6 +740,7 @@ static void free_trace(trace_t *trace) {
   free(trace->blocks);
   free(trace->block_sizes);
   free(trace->block_rand_base);
+  free(trace->batch);
   free(trace); /* and the trace record itself... */
 }
 
@@ -645,9 +785,22 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
     }
 
     switch (trace->ops[i].type) {
-      case ALLOC: /* mm_malloc */
+      case ALLOC:    /* mm_malloc */
+      case MEMALIGN: /* mm_memalign */
         /* Call the student's malloc */
-        if ((p = mm_malloc(size)) == NULL) {
+        if (trace->ops[i].type == MEMALIGN) {
+          size_t align = trace->ops[i].align;
+
+          if ((p = mm_memalign(align, size)) == NULL) {
+            malloc_error(trace, i, "mm_memalign failed.");
+            return 0;
+          }
+          if ((unsigned long)p % align) {
+            malloc_error(trace, i, "Payload address (%p) not aligned to %zu "
+                         "bytes", p, align);
+            return 0;
+          }
+        } else if ((p = mm_malloc(size)) == NULL) {
           malloc_error(trace, i, "mm_malloc failed.");
           return 0;
         }
@@ -715,6 +868,32 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
         mm_free(p);
         break;
 
+      case BATCH_ALLOC: /* mm_malloc_batch */
+        if (mm_malloc_batch(size, trace->ops[i].count,
+                            (void **)&trace->blocks[index]) !=
+            trace->ops[i].count) {
+          malloc_error(trace, i, "mm_malloc_batch failed.");
+          return 0;
+        }
+
+        /* Check, remember and randomize every block of the batch */
+        for (int k = index; k < index + trace->ops[i].count; k++) {
+          if (add_range(ranges, trace->blocks[k], size, trace, i, k) == 0)
+            return 0;
+          trace->block_sizes[k] = size;
+          randomize_block(trace, k);
+        }
+        break;
+
+      case BATCH_FREE: /* mm_free_batch */
+        for (int k = 0; k < trace->ops[i].count; k++) {
+          check_index(trace, i, index + k);
+          remove_range(ranges, trace->blocks[index + k]);
+          trace->batch[k] = trace->blocks[index + k];
+        }
+        mm_free_batch(trace->batch, trace->ops[i].count);
+        break;
+
       default:
         app_error("Nonexistent request type in eval_mm_valid");
     }
@@ -728,11 +907,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   Utilization is the ratio hwm/peaksize, where peaksize is the
+ *   highest size of the heap plus the regions mapped by the student's
+ *   malloc package while running the trace. The heap may shrink, so
+ *   peaksize is tracked by memlib rather than taken from the final brk.
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -748,16 +926,21 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
     app_error("trace: mm_init failed in eval_mm_util");
 
   for (int i = 0; i < trace->num_ops; i++) {
-    int index, size, newsize, oldsize;
+    int index, size, newsize, oldsize, count;
     char *p, *newp, *oldp;
 
     switch (trace->ops[i].type) {
-      case ALLOC: /* mm_alloc */
+      case ALLOC:    /* mm_alloc */
+      case MEMALIGN: /* mm_memalign */
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
-        if ((p = mm_malloc(size)) == NULL)
-          app_error("trace: mm_malloc failed in eval_mm_util");
+        if (trace->ops[i].type == MEMALIGN)
+          p = mm_memalign(trace->ops[i].align, size);
+        else
+          p = mm_malloc(size);
+        if (p == NULL)
+          app_error("trace: mm_malloc or mm_memalign failed in eval_mm_util");
 
         /* Remember region and size */
         trace->blocks[index] = p;
@@ -797,6 +980,33 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
         total_size -= size;
         break;
 
+      case BATCH_ALLOC: /* mm_malloc_batch */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        count = trace->ops[i].count;
+
+        if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) !=
+            count)
+          app_error("trace: mm_malloc_batch failed in eval_mm_util");
+
+        for (int k = index; k < index + count; k++)
+          trace->block_sizes[k] = size;
+
+        total_size += size * count;
+        break;
+
+      case BATCH_FREE: /* mm_free_batch */
+        index = trace->ops[i].index;
+        count = trace->ops[i].count;
+
+        for (int k = 0; k < count; k++) {
+          trace->batch[k] = trace->blocks[index + k];
+          total_size -= trace->block_sizes[index + k];
+        }
+
+        mm_free_batch(trace->batch, count);
+        break;
+
       default:
         app_error("trace: Nonexistent request type in eval_mm_util");
     }
@@ -807,9 +1017,9 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
   }
 
   *used_p = max_total_size;
-  *total_p = mem_heapsize();
+  *total_p = mem_peaksize();
 
-  return ((double)max_total_size / (double)mem_heapsize());
+  return ((double)max_total_size / (double)mem_peaksize());
 }
 
 /*
@@ -839,6 +1049,14 @@ static void eval_mm_speed(void *ptr) {
         trace->blocks[index] = p;
         break;
 
+      case MEMALIGN: /* mm_memalign */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+          app_error("mm_memalign error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
       case REALLOC: /* mm_realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
@@ -858,6 +1076,21 @@ static void eval_mm_speed(void *ptr) {
         mm_free(block);
         break;
 
+      case BATCH_ALLOC: /* mm_malloc_batch */
+        index = trace->ops[i].index;
+        if (mm_malloc_batch(trace->ops[i].size, trace->ops[i].count,
+                            (void **)&trace->blocks[index]) !=
+            trace->ops[i].count)
+          app_error("mm_malloc_batch error in eval_mm_speed");
+        break;
+
+      case BATCH_FREE: /* mm_free_batch */
+        index = trace->ops[i].index;
+        memcpy(trace->batch, &trace->blocks[index],
+               trace->ops[i].count * sizeof(void *));
+        mm_free_batch(trace->batch, trace->ops[i].count);
+        break;
+
       default:
         app_error("Nonexistent request type in eval_mm_speed");
     }
@@ -886,6 +1119,15 @@ static int eval_libc_valid(trace_t *trace) {
         trace->blocks[trace->ops[i].index] = p;
         break;
 
+      case MEMALIGN: /* aligned_alloc */
+        if ((p = aligned_alloc(trace->ops[i].align, trace->ops[i].size)) ==
+            NULL) {
+          malloc_error(trace, i, "libc aligned_alloc failed");
+          unix_error("System message");
+        }
+        trace->blocks[trace->ops[i].index] = p;
+        break;
+
       case REALLOC: /* realloc */
         newsize = trace->ops[i].size;
         oldp = trace->blocks[trace->ops[i].index];
@@ -904,6 +1146,21 @@ static int eval_libc_valid(trace_t *trace) {
         }
         break;
 
+      case BATCH_ALLOC: /* malloc of every block */
+        for (int k = 0; k < trace->ops[i].count; k++) {
+          if ((p = malloc(trace->ops[i].size)) == NULL) {
+            malloc_error(trace, i, "libc malloc failed");
+            unix_error("System message");
+          }
+          trace->blocks[trace->ops[i].index + k] = p;
+        }
+        break;
+
+      case BATCH_FREE: /* free of every block */
+        for (int k = 0; k < trace->ops[i].count; k++)
+          free(trace->blocks[trace->ops[i].index + k]);
+        break;
+
       default:
         app_error("invalid operation type  in eval_libc_valid");
     }
@@ -935,6 +1192,14 @@ static void eval_libc_speed(void *ptr) {
         trace->blocks[index] = p;
         break;
 
+      case MEMALIGN: /* aligned_alloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = aligned_alloc(trace->ops[i].align, size)) == NULL)
+          unix_error("aligned_alloc failed in eval_libc_speed");
+        trace->blocks[index] = p;
+        break;
+
       case REALLOC: /* realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
@@ -954,21 +1219,368 @@ static void eval_libc_speed(void *ptr) {
           free(0);
         }
         break;
+
+      case BATCH_ALLOC: /* malloc of every block */
+        index = trace->ops[i].index;
+        for (int k = 0; k < trace->ops[i].count; k++)
+          if ((trace->blocks[index + k] = malloc(trace->ops[i].size)) == NULL)
+            unix_error("malloc failed in eval_libc_speed");
+        break;
+
+      case BATCH_FREE: /* free of every block */
+        index = trace->ops[i].index;
+        for (int k = 0; k < trace->ops[i].count; k++)
+          free(trace->blocks[index + k]);
+        break;
     }
   }
 }
 
+/*****************************************************************
+ * The following routines tune the size classes of the mm malloc
+ * package to the traces (-T). Requests of every size are counted
+ * together with the blocks of that size given back, which are the
+ * ones pushed onto the free lists. Sizes taking a big part of the
+ * requests get singular classes, the rest is split into ranged
+ * classes of equal numbers of requests, and the chunk size is the
+ * one of the best utilization.
+ ****************************************************************/
+
+/*
+ * size_compare - Order counts of requests by their size, for qsort
+ */
+static int size_compare(const void *a, const void *b) {
+  size_t x = ((const sizestat_t *)a)->size;
+  size_t y = ((const sizestat_t *)b)->size;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * size_histogram - Count requests and frees of every size in the traces;
+ *     returns an array of counts ordered by size and stores its length.
+ */
+static sizestat_t *size_histogram(trace_t **traces, int num_traces,
+                                  int *num_sizes) {
+  int num = 0;
+  int max = 0;
+
+  for (int t = 0; t < num_traces; t++)
+    for (int i = 0; i < traces[t]->num_ops; i++)
+      max += 2 * traces[t]->ops[i].count;
+
+  sizestat_t *sizes = malloc((max + 1) * sizeof(sizestat_t));
+  if (sizes == NULL)
+    unix_error("malloc failed in size_histogram");
+
+  for (int t = 0; t < num_traces; t++) {
+    trace_t *trace = traces[t];
+    reinit_trace(trace);
+
+    for (int i = 0; i < trace->num_ops; i++) {
+      int type = trace->ops[i].type;
+      int frees = type == FREE || type == BATCH_FREE;
+
+      /* every block of a batch counts as a request of its own */
+      for (int k = 0; k < trace->ops[i].count; k++) {
+        int index = trace->ops[i].index + k;
+        size_t old_size = index >= 0 ? trace->block_sizes[index] : 0;
+
+        /* the old block of a realloc is given back as well */
+        if ((frees || type == REALLOC) && old_size > 0)
+          sizes[num++] = (sizestat_t){old_size, 0, 1};
+
+        if (!frees && trace->ops[i].size > 0)
+          sizes[num++] = (sizestat_t){trace->ops[i].size, 1, 0};
+
+        if (index >= 0)
+          trace->block_sizes[index] = frees ? 0 : trace->ops[i].size;
+      }
+    }
+  }
+
+  qsort(sizes, num, sizeof(sizestat_t), size_compare);
+
+  /* merge the counts of equal sizes */
+  int merged = 0;
+  for (int i = 0; i < num; i++) {
+    if (merged > 0 && sizes[merged - 1].size == sizes[i].size) {
+      sizes[merged - 1].allocs += sizes[i].allocs;
+      sizes[merged - 1].frees += sizes[i].frees;
+    } else {
+      sizes[merged++] = sizes[i];
+    }
+  }
+
+  *num_sizes = merged;
+  return sizes;
+}
+
+/*
+ * tune_units - Number of ALIGNMENT units of the block of a request, with a
+ *     header of at most 8 bytes
+ */
+static int tune_units(size_t size) {
+  return (size + 8 + ALIGNMENT - 1) / ALIGNMENT;
+}
+
+/*
+ * tune_layout - Choose the number of singular classes and the limits of the
+ *     ranged classes for the counted sizes; returns the number of limits.
+ */
+static int tune_layout(const sizestat_t *sizes, int num_sizes, int max_singular,
+                       int max_classes, int *singular_p, size_t *limits) {
+  long total = 0;
+
+  for (int i = 0; i < num_sizes && sizes[i].size < TUNE_MAPPED; i++)
+    total += sizes[i].allocs + sizes[i].frees;
+
+  /* hot sizes which fit the singular lists get a class of their own */
+  int singular = TUNE_MIN_SINGULAR;
+
+  for (int i = 0; i < num_sizes; i++) {
+    int units = tune_units(sizes[i].size);
+    long weight = sizes[i].allocs + sizes[i].frees;
+
+    if (units <= max_singular && units > singular && weight * TUNE_HOT >= total)
+      singular = units;
+  }
+
+  /* the other sizes are split into classes of about equal weight */
+  int num = max_classes - singular - 1;
+  long ranged = 0;
+
+  for (int i = 0; i < num_sizes && sizes[i].size < TUNE_MAPPED; i++)
+    if (tune_units(sizes[i].size) > singular)
+      ranged += sizes[i].allocs + sizes[i].frees;
+
+  int num_limits = 0;
+  long acc = 0;
+
+  /* a size of the weight of many classes leaves them to the sizes after it */
+  for (int i = 0; i < num_sizes && sizes[i].size < TUNE_MAPPED; i++) {
+    if (tune_units(sizes[i].size) <= singular)
+      continue;
+
+    acc += sizes[i].allocs + sizes[i].frees;
+
+    if (num_limits < num && acc * num >= (num_limits + 1) * ranged)
+      limits[num_limits++] = sizes[i].size;
+  }
+
+  *singular_p = singular;
+  return num_limits;
+}
+
+/*
+ * tune_split - Split the widest class in two, counting the class of the
+ *     biggest requests up to the mapped ones; returns 0 if all classes are
+ *     too narrow.
+ */
+static int tune_split(size_t *limits, int *num_limits_p, int singular) {
+  int num_limits = *num_limits_p;
+  int widest = 0;
+  double widest_ratio = 0.0;
+
+  for (int i = 0; i <= num_limits; i++) {
+    double lo = i > 0 ? limits[i - 1] : singular * ALIGNMENT;
+    double hi = i < num_limits ? limits[i] : TUNE_MAPPED;
+
+    if (hi / lo > widest_ratio) {
+      widest = i;
+      widest_ratio = hi / lo;
+    }
+  }
+
+  if (widest_ratio < TUNE_MIN_RATIO)
+    return 0;
+
+  size_t lo = widest > 0 ? limits[widest - 1] : singular * ALIGNMENT;
+  size_t hi = widest < num_limits ? limits[widest] : TUNE_MAPPED;
+
+  memmove(&limits[widest + 1], &limits[widest],
+          (num_limits - widest) * sizeof(size_t));
+  limits[widest] = (lo + hi) / 2;
+  *num_limits_p = num_limits + 1;
+
+  return 1;
+}
+
+/*
+ * tune_eval - Run the mm malloc package on every trace with the current
+ *     size classes; stores the average utilization and, unless secs_p is
+ *     NULL, the total running time.
+ */
+static void tune_eval(trace_t **traces, int num_traces, double *util_p,
+                      double *secs_p) {
+  speed_t speed_params = {NULL, NULL};
+  double util = 0.0, secs = 0.0;
+  int used, total;
+
+  for (int t = 0; t < num_traces; t++) {
+    util += eval_mm_util(traces[t], &used, &total);
+
+    if (secs_p != NULL) {
+      speed_params.trace = traces[t];
+      secs += fsecs(eval_mm_speed, &speed_params);
+    }
+  }
+
+  *util_p = util / num_traces;
+  if (secs_p != NULL)
+    *secs_p = secs;
+}
+
+/*
+ * tune_classes - Tune the size classes and the chunk size to the traces,
+ *     print the counts of requests in every class, the utilization and
+ *     throughput before and after, and the calls which set the layout.
+ */
+static void tune_classes(char **tracefiles, int num_traces) {
+  trace_t **traces = calloc(num_traces, sizeof(trace_t *));
+  stats_t stats;
+  double ops = 0.0;
+
+  mem_init();
+
+  for (int t = 0; t < num_traces; t++) {
+    traces[t] = read_trace(&stats, tracefiles[t]);
+    ops += traces[t]->num_ops;
+  }
+
+  int num_sizes;
+  sizestat_t *sizes = size_histogram(traces, num_traces, &num_sizes);
+
+  /* the layout set at build time */
+  int singular;
+  size_t limits[MM_CLASSES_MAX];
+  int num_limits = mm_get_classes(&singular, limits);
+  int max_singular = singular;
+  int max_classes = singular + num_limits + 1;
+
+  double default_util, default_secs;
+  tune_eval(traces, num_traces, &default_util, &default_secs);
+
+  num_limits = tune_layout(sizes, num_sizes, max_singular, max_classes,
+                           &singular, limits);
+
+  /* limits which mm_set_classes merges leave classes to split, until a split
+     is merged as well, as the next one would split the same class again */
+  for (int split_limits = 0;;) {
+    if (!mm_set_classes(singular, limits, num_limits))
+      app_error("mm_set_classes rejected the tuned size classes\n");
+
+    num_limits = mm_get_classes(&singular, limits);
+
+    if (num_limits < split_limits ||
+        singular + num_limits + 1 >= max_classes ||
+        !tune_split(limits, &num_limits, singular))
+      break;
+
+    split_limits = num_limits;
+  }
+
+  /* the chunk size of the best utilization, the smallest one of equals */
+  int chunk = 0;
+  double util, secs, best_util = 0.0;
+
+  for (int c = 0; c < TUNE_CHUNKS; c++) {
+    mm_mallopt(MM_CHUNK_SIZE, mem_pagesize() << c);
+    tune_eval(traces, num_traces, &util, NULL);
+
+    if (chunk == 0 || util > best_util) {
+      chunk = mem_pagesize() << c;
+      best_util = util;
+    }
+  }
+
+  /* the chunk size of the tries raised the biggest chunk along */
+  mm_mallopt(MM_CHUNK_SIZE, chunk);
+  mm_mallopt(MM_CHUNK_MAX, chunk);
+
+  /* the tuned layout must pass the checks of the driver as well */
+  range_t *ranges = NULL;
+
+  for (int t = 0; t < num_traces; t++)
+    if (!eval_mm_valid(traces[t], &ranges))
+      app_error("%s: not valid with the tuned size classes\n",
+                traces[t]->filename);
+
+  clear_ranges(&ranges);
+  tune_eval(traces, num_traces, &util, &secs);
+
+  if (verbose) {
+    printf("\nSize classes tuned to %d traces:\n", num_traces);
+    printf("%10s %10s %10s\n", "requests", "allocs", "frees");
+
+    /* counts of the singular classes and of the classes ending at limits */
+    int s = 0;
+    for (int c = -1; c <= num_limits; c++) {
+      long allocs = 0, frees = 0;
+      char range[32];
+
+      if (c < 0)
+        sprintf(range, "%d exact", singular);
+      else if (c < num_limits)
+        sprintf(range, "<= %lu", (unsigned long)limits[c]);
+      else
+        sprintf(range, "bigger");
+
+      for (; s < num_sizes; s++) {
+        if (c < 0 ? tune_units(sizes[s].size) > singular
+                  : c < num_limits && sizes[s].size > limits[c])
+          break;
+        allocs += sizes[s].allocs;
+        frees += sizes[s].frees;
+      }
+
+      printf("%10s %10ld %10ld\n", range, allocs, frees);
+    }
+
+    printf("chunk size %d\n", chunk);
+  }
+
+  printf("\n%-8s%6s%10s%7s\n", "", "util", "secs", "Kops");
+  printf("%-8s%5.1f%%%10.6f%7.0f\n", "default", default_util * 100.0,
+         default_secs, ops / 1e3 / default_secs);
+  printf("%-8s%5.1f%%%10.6f%7.0f\n", "tuned", util * 100.0, secs,
+         ops / 1e3 / secs);
+
+  /* the calls which set the tuned layout */
+  printf("\nstatic const size_t classes[] = {");
+  for (int i = 0; i < num_limits; i++)
+    printf("%s%lu", i == 0 ? "\n  " : i % 8 ? ", " : ",\n  ",
+           (unsigned long)limits[i]);
+  printf("};\n");
+  printf("mm_set_classes(%d, classes, %d);\n", singular, num_limits);
+  printf("mm_mallopt(MM_CHUNK_SIZE, %d);\n", chunk);
+  printf("mm_mallopt(MM_CHUNK_MAX, %d);\n", chunk);
+
+  free(sizes);
+  for (int t = 0; t < num_traces; t++)
+    free_trace(traces[t]);
+  free(traces);
+
+  mem_deinit();
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
 
+/*
+ * printheader - prints the header of the table of performance summaries
+ */
+static void printheader(void) {
+  printf("  %2s%6s%8s%8s %5s%8s%10s  %s\n", "valid", "util", "used", "total",
+         "ops", "secs", "Kops", "trace");
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
 static void printresults(stats_t *stats) {
   /* Print the individual results for each trace */
-  printf("  %2s%6s%8s%8s %5s%8s%10s  %s\n", "valid", "util", "used", "total",
-         "ops", "secs", "Kops", "trace");
   if (!stats->valid) {
     printf("%2s%4s %6s%8s%10s%7s %s\n", stats->weight != 0 ? "*" : "", "no",
            "-", "-", "-", "-", stats->filename);
@@ -1054,13 +1666,21 @@ static void malloc_error(const trace_t *trace, int opnum, const char *fmt,
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-  fprintf(stderr, "Usage: mdriver [-hlVD] [-d <i>] [-v <i>] [-f <file>]\n");
+  fprintf(stderr,
+          "Usage: mdriver [-hHlTVD] [-b <i>] [-d <i>] [-v <i>] [-f <file>] "
+          "[<file>...]\n");
   fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-b <i>     Heap: 0 simulated; 1 reserved; 2 segmented.\n");
   fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
   fprintf(stderr, "\t-D         Equivalent to -d2.\n");
   fprintf(stderr, "\t-h         Print this message.\n");
+  fprintf(stderr, "\t-H         Back the heap by transparent huge pages.\n");
   fprintf(stderr, "\t-l         Run libc malloc instead mm.\n");
+  fprintf(stderr, "\t-T         Tune size classes of mm to the traces.\n");
   fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
   fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
   fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+  fprintf(stderr, "Trace files after the options are run too, and for more "
+                  "than one trace\nthe average utilization and the "
+                  "throughput of all of them are printed.\n");
 }
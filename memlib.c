@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -11,60 +12,576 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #include "memlib.h"
 
+/* The heap is made of segments; all but the simulated and reserved heaps,
+   which are a single segment of MAX_HEAP bytes, lie within MAX_HEAP bytes
+   from the first one, where the allocator expects them */
+#define SEGMENT_SIZE (1L << 24) /* Size of a segment of the segmented heap */
+#define MAX_SEGMENTS (MAX_HEAP / SEGMENT_SIZE + 1)
+
+typedef struct segment {
+  unsigned char *lo;    /* first byte of the segment */
+  unsigned char *brk;   /* first byte past the used part */
+  unsigned char *max;   /* first byte past the reserved part */
+  unsigned char *fresh; /* first byte not handed out since it read as zeros */
+} segment_t;
+
+/* Operations of a backend of the heap */
+typedef struct backend {
+  /* reserve size bytes of address space at hint, or anywhere if it is NULL;
+     returns NULL on failure */
+  unsigned char *(*reserve)(unsigned char *hint, size_t size);
+  /* make the pages from addr to addr + size usable, returns 0 on success;
+     NULL when reserved pages are usable already */
+  int (*commit)(unsigned char *addr, size_t size);
+  /* give the pages from addr to addr + size back to the system */
+  void (*decommit)(unsigned char *addr, size_t size);
+  size_t segment_size; /* size of further segments, 0 if there are none */
+} backend_t;
+
 /* private variables */
-static unsigned char *heap;
-static unsigned char *mem_brk;
-static unsigned char *mem_max_addr;
+static const backend_t *backend;
+static segment_t segments[MAX_SEGMENTS];
+static int num_segments;
+static segment_t *last;     /* segment of the brk, the last one */
+static unsigned char *heap; /* first byte of the first segment */
+static size_t heap_size;    /* total size of the used parts of segments */
+static int huge;            /* heap is backed by transparent huge pages */
+static size_t page_size;    /* size of pages committed and given back */
+
+#define HUGE_PAGE_SIZE (1L << 21) /* Size of a transparent huge page */
+
+/* regions mapped outside of the heap, listed and indexed by their address */
+typedef struct mapping {
+  unsigned char *addr;
+  size_t size;
+  struct mapping *next;  /* next mapping, or next unused record */
+  struct mapping **link; /* link pointing at the mapping in the list */
+  struct mapping *chain; /* next mapping in the same bucket of the index */
+} mapping_t;
+
+#define INDEX_SHIFT 16 /* The index of mappings has 2^INDEX_SHIFT buckets */
+
+static mapping_t *mappings;
+static mapping_t *mapping_index[1 << INDEX_SHIFT];
+static mapping_t *free_records; /* unused records of mappings */
+static size_t mapped_size; /* total size of the mapped regions */
+static unsigned char *map_hint; /* where mappings above the heap go next */
+static size_t peak_size;   /* highest heap size plus mapped size */
+
+/*
+ * simulated_reserve - reserve the heap at a fixed address, writable from
+ *    the start; pages are only backed by memory once touched
+ */
+static unsigned char *simulated_reserve(unsigned char *hint, size_t size) {
+  void *addr = mmap((void *)0x800000000, /* suggested start */
+                    size,                /* length */
+                    PROT_WRITE,          /* permissions */
+                    MAP_PRIVATE | MAP_ANON |
+                      MAP_NORESERVE, /* private or shared? only reserved */
+                    -1,              /* fd */
+                    0);              /* offset (dunno) */
+
+  return addr == MAP_FAILED ? NULL : addr;
+}
+
+/*
+ * reserved_reserve - reserve inaccessible address space at hint, or where
+ *    the system chooses if hint is NULL
+ */
+static unsigned char *reserved_reserve(unsigned char *hint, size_t size) {
+  int flags = MAP_PRIVATE | MAP_ANON | MAP_NORESERVE;
+  void *addr = mmap(hint, size, PROT_NONE,
+                    hint ? flags | MAP_FIXED_NOREPLACE : flags, -1, 0);
+
+  if (addr == MAP_FAILED)
+    return NULL;
+
+  /* kernels without MAP_FIXED_NOREPLACE take hint as a hint only */
+  if (hint && addr != hint) {
+    munmap(addr, size);
+    return NULL;
+  }
+
+  return addr;
+}
+
+/*
+ * reserved_commit - make reserved pages readable and writable
+ */
+static int reserved_commit(unsigned char *addr, size_t size) {
+  return mprotect(addr, size, PROT_READ | PROT_WRITE);
+}
+
+/*
+ * reserved_decommit - give pages back and make them inaccessible again
+ */
+static void reserved_decommit(unsigned char *addr, size_t size) {
+  madvise(addr, size, MADV_DONTNEED);
+  mprotect(addr, size, PROT_NONE);
+}
+
+/*
+ * simulated_decommit - give pages back, they read as zeros when touched
+ */
+static void simulated_decommit(unsigned char *addr, size_t size) {
+  madvise(addr, size, MADV_DONTNEED);
+}
+
+static const backend_t backends[] = {
+  [MEM_SIMULATED] = {simulated_reserve, NULL, simulated_decommit, 0},
+  [MEM_RESERVED] = {reserved_reserve, reserved_commit, reserved_decommit, 0},
+  [MEM_SEGMENTED] = {reserved_reserve, reserved_commit, reserved_decommit,
+                     SEGMENT_SIZE},
+};
+
+/*
+ * update_peak - remember the highest memory footprint
+ */
+static void update_peak(void) {
+  size_t size = heap_size + mapped_size;
+
+  if (size > peak_size)
+    peak_size = size;
+}
+
+/*
+ * record_alloc - take a record of a mapping from pages of their own, as
+ *    the allocator may be the malloc of the process; returns NULL on failure
+ */
+static mapping_t *record_alloc(void) {
+  if (free_records == NULL) {
+    size_t size = mem_pagesize();
+    mapping_t *page = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (page == MAP_FAILED)
+      return NULL;
+    for (size_t i = 0; i < size / sizeof(mapping_t); i++) {
+      page[i].next = free_records;
+      free_records = &page[i];
+    }
+  }
+
+  mapping_t *m = free_records;
+
+  free_records = m->next;
+  return m;
+}
+
+/*
+ * record_free - give back a record taken by record_alloc
+ */
+static void record_free(mapping_t *m) {
+  m->next = free_records;
+  free_records = m;
+}
+
+/*
+ * unmap_all - unmap all regions mapped with mem_map
+ */
+static void unmap_all(void) {
+  while (mappings)
+    mem_unmap(mappings->addr);
+}
+
+/*
+ * mem_set_backend - choose the backend used by the next mem_init, with
+ *    MEM_HUGE added to back the heap by transparent huge pages
+ */
+void mem_set_backend(int id) {
+  huge = (id & MEM_HUGE) != 0;
+  id &= ~MEM_HUGE;
+  assert(id >= MEM_SIMULATED && id <= MEM_SEGMENTED);
+  backend = &backends[id];
+}
+
+/*
+ * reserve - reserve a segment of the heap with the backend. Segments of a
+ *    heap backed by huge pages are aligned to them and advised to use them.
+ */
+static unsigned char *reserve(unsigned char *hint, size_t size) {
+  if (!huge)
+    return backend->reserve(hint, size);
+
+  /* hints are aligned already, otherwise the ends are cut off */
+  size_t slack = hint ? 0 : HUGE_PAGE_SIZE;
+  unsigned char *addr = backend->reserve(hint, size + slack);
+
+  if (addr == NULL)
+    return NULL;
+
+  unsigned char *lo =
+    (unsigned char *)(((uintptr_t)addr + HUGE_PAGE_SIZE - 1) &
+                      ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  if (lo > addr)
+    munmap(addr, lo - addr);
+  if (addr + size + slack > lo + size)
+    munmap(lo + size, addr + size + slack - (lo + size));
+
+  madvise(lo, size, MADV_HUGEPAGE);
+  return lo;
+}
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void) {
-  heap = mmap((void *)0x800000000,    /* suggested start */
-              MAX_HEAP,               /* length */
-              PROT_WRITE,             /* permissions */
-              MAP_PRIVATE | MAP_ANON, /* private or shared? */
-              -1,                     /* fd */
-              0);                     /* offset (dunno) */
-  mem_max_addr = heap + MAX_HEAP;
-  mem_brk = heap; /* heap is empty initially */
+  if (backend == NULL)
+    backend = &backends[MEM_SIMULATED];
+
+  size_t size = backend->segment_size ? backend->segment_size : MAX_HEAP;
+
+  page_size = huge ? HUGE_PAGE_SIZE : mem_pagesize();
+  heap = reserve(NULL, size);
+  if (heap == NULL) {
+    fprintf(stderr, "ERROR: mem_init failed to reserve the heap\n");
+    exit(EXIT_FAILURE);
+  }
+
+  segments[0] = (segment_t){heap, heap, heap + size, heap};
+  num_segments = 1;
+  last = &segments[0];
+  heap_size = 0;
+  peak_size = 0;
 }
 
 /*
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void) {
-  munmap(heap, MAX_HEAP);
+  unmap_all();
+  for (int i = 0; i < num_segments; i++)
+    munmap(segments[i].lo, segments[i].max - segments[i].lo);
+  num_segments = 0;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * page_round - round address up to the size of pages committed and given
+ *    back, which are huge pages if they back the heap, so they are never
+ *    split
+ */
+static unsigned char *page_round(unsigned char *addr) {
+  return heap + (((size_t)(addr - heap) + page_size - 1) & ~(page_size - 1));
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    unmap all mapped regions and reset the peak footprint. Backends which
+ *    commit pages give them back, and further segments are unmapped.
  */
 void mem_reset_brk() {
-  mem_brk = heap;
+  for (int i = num_segments - 1; i > 0; i--)
+    munmap(segments[i].lo, segments[i].max - segments[i].lo);
+  num_segments = 1;
+  last = &segments[0];
+
+  if (backend->commit && last->brk > heap) {
+    backend->decommit(heap, page_round(last->brk) - heap);
+    if (last->fresh <= page_round(last->brk))
+      last->fresh = heap;
+  }
+
+  last->brk = heap;
+  heap_size = 0;
+  unmap_all();
+  peak_size = 0;
+}
+
+/*
+ * new_segment - reserve a segment for at least size bytes after the last
+ *    one, leaving a guard page between them. Returns 0 if the heap has no
+ *    further segments or there is no room for one.
+ */
+static int new_segment(size_t size) {
+  size_t seg_size = backend->segment_size;
+
+  if (seg_size == 0 || num_segments == MAX_SEGMENTS)
+    return 0;
+
+  if (size > seg_size)
+    seg_size = (size + page_size - 1) & ~(page_size - 1);
+
+  /* the first free place in the window of the heap */
+  for (unsigned char *hint = last->max + page_size;
+       hint + seg_size <= heap + MAX_HEAP; hint += seg_size) {
+    unsigned char *lo = reserve(hint, seg_size);
+
+    if (lo != NULL) {
+      last = &segments[num_segments++];
+      *last = (segment_t){lo, lo, lo + seg_size, lo};
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * mem_fresh - address from which on the memory at the brk has not been
+ *    handed out by mem_sbrk since it last read as zeros; memory mem_sbrk
+ *    returns from there, or from a new segment, is zeroed
+ */
+void *mem_fresh(void) {
+  return last->fresh;
+}
+
+/*
+ * mem_room - number of bytes the heap can grow by at its brk, before
+ *    mem_sbrk starts a new segment
+ */
+size_t mem_room(void) {
+  return last->max - last->brk;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    If the segment of the brk has no room left, the area is the start
+ *    of a new segment, which is page aligned.
+ *    If incr is negative, the heap is shrunk within the segment of the
+ *    brk and the pages above the new brk are given back to the system.
  */
 void *mem_sbrk(long incr) {
-  unsigned char *old_brk = mem_brk;
-
-  if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+  if (incr < 0 ? last->brk - last->lo < -incr
+               : (size_t)incr > mem_room() && !new_segment(incr)) {
     errno = ENOMEM;
     fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
     return (void *)-1;
   }
 
-  mem_brk += incr;
+  /* the start of a new segment if one was started */
+  unsigned char *old_brk = last->brk;
+  unsigned char *new_brk = old_brk + incr;
+
+  if (incr > 0 && backend->commit &&
+      page_round(new_brk) > page_round(old_brk) &&
+      backend->commit(page_round(old_brk),
+                      page_round(new_brk) - page_round(old_brk))) {
+    errno = ENOMEM;
+    fprintf(stderr, "ERROR: mem_sbrk failed to commit memory...\n");
+    return (void *)-1;
+  }
+
+  if (incr < 0 && page_round(new_brk) < page_round(old_brk)) {
+    backend->decommit(page_round(new_brk),
+                      page_round(old_brk) - page_round(new_brk));
+    if (last->fresh <= page_round(old_brk))
+      last->fresh = page_round(new_brk);
+  }
+
+  if (new_brk > last->fresh)
+    last->fresh = new_brk;
+
+  last->brk = new_brk;
+  heap_size += incr;
+
+  update_peak();
   return (void *)old_brk;
 }
 
+/*
+ * mem_release - model of madvise(MADV_DONTNEED). Gives the pages from
+ *    addr to addr + size, which must be page aligned, back to the system.
+ *    They read as zeros when touched again. Only whole huge pages are
+ *    given back if they back the heap.
+ */
+void mem_release(void *addr, size_t size) {
+  unsigned char *lo = page_round(addr);
+  unsigned char *hi = (unsigned char *)addr + size;
+
+  hi = heap + ((size_t)(hi - heap) & ~(page_size - 1));
+
+  if (lo < hi)
+    madvise(lo, hi - lo, MADV_DONTNEED);
+}
+
+/*
+ * bucket - the bucket of the index of mappings for the address addr
+ */
+static mapping_t **bucket(void *addr) {
+  uint64_t hash = ((uintptr_t)addr >> 12) * 0x9e3779b97f4a7c15ull;
+
+  return &mapping_index[hash >> (64 - INDEX_SHIFT)];
+}
+
+/*
+ * index_add - add the mapping m to the bucket of its address
+ */
+static void index_add(mapping_t *m) {
+  mapping_t **p = bucket(m->addr);
+
+  m->chain = *p;
+  *p = m;
+}
+
+/*
+ * find_mapping - return the link of the index pointing at the mapping
+ *    starting at addr
+ */
+static mapping_t **find_mapping(void *addr) {
+  mapping_t **p = bucket(addr);
+
+  while (*p && (*p)->addr != addr)
+    p = &(*p)->chain;
+
+  return p;
+}
+
+/*
+ * in_window - does the region of size bytes at addr overlap the window of
+ *    the heap, where segments are not reserved in advance
+ */
+static int in_window(void *addr, size_t size) {
+  return (unsigned char *)addr + size > heap &&
+         (unsigned char *)addr < heap + MAX_HEAP;
+}
+
+/*
+ * map_region - map size bytes of anonymous memory outside of the window of
+ *    the heap, as the allocator tells mapped blocks by their address, and
+ *    return the address, or MAP_FAILED. Places the system picks in the
+ *    window are held until it picks one outside, so it does not pick them
+ *    again; mappings grown in place may be in the way of the hint.
+ */
+static void *map_region(size_t size) {
+  unsigned char *held = NULL; /* places in the window, linked by first word */
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (addr == MAP_FAILED || !in_window(addr, size))
+    return addr;
+
+  while (addr != MAP_FAILED && in_window(addr, size)) {
+    *(unsigned char **)addr = held;
+    held = addr;
+    if (map_hint < heap + MAX_HEAP)
+      map_hint = heap + MAX_HEAP;
+    addr = mmap(map_hint, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+
+  while (held != NULL) {
+    unsigned char *next = *(unsigned char **)held;
+
+    munmap(held, size);
+    held = next;
+  }
+
+  /* the next mapping is tried past this one, which may take the hint */
+  if (addr != MAP_FAILED)
+    map_hint = (unsigned char *)addr + size;
+
+  return addr;
+}
+
+/*
+ * mem_map - model of mmap of anonymous memory. Maps a region of size
+ *    bytes, a multiple of the page size, outside of the heap and returns
+ *    its address, or (void *)-1 on failure.
+ */
+void *mem_map(size_t size) {
+  mapping_t *m = record_alloc();
+  void *addr = map_region(size);
+
+  if (m == NULL || addr == MAP_FAILED) {
+    if (m != NULL)
+      record_free(m);
+    if (addr != MAP_FAILED)
+      munmap(addr, size);
+    errno = ENOMEM;
+    return (void *)-1;
+  }
+
+  m->addr = addr;
+  m->size = size;
+  m->next = mappings;
+  m->link = &mappings;
+  if (mappings)
+    mappings->link = &m->next;
+  mappings = m;
+  index_add(m);
+
+  mapped_size += size;
+  update_peak();
+  return addr;
+}
+
+/*
+ * mem_unmap - unmap the region mapped by mem_map at addr
+ */
+void mem_unmap(void *addr) {
+  mapping_t **p = find_mapping(addr);
+  mapping_t *m = *p;
+
+  assert(m != NULL);
+
+  *p = m->chain;
+  *m->link = m->next;
+  if (m->next)
+    m->next->link = m->link;
+
+  munmap(m->addr, m->size);
+  mapped_size -= m->size;
+  record_free(m);
+}
+
+/*
+ * mem_remap - model of mremap. Changes the size of the region mapped at
+ *    addr to size bytes, moving it if needed, and returns its new address,
+ *    or (void *)-1 on failure. A region which cannot grow in place is
+ *    moved onto a new region outside of the heap, as mem_map places them.
+ */
+void *mem_remap(void *addr, size_t size) {
+  mapping_t **p = find_mapping(addr);
+  mapping_t *m = *p;
+
+  assert(m != NULL);
+
+  addr = mremap(m->addr, m->size, size, 0);
+
+  if (addr == MAP_FAILED) {
+    void *to = map_region(size);
+
+    if (to != MAP_FAILED) {
+      addr = mremap(m->addr, m->size, size, MREMAP_MAYMOVE | MREMAP_FIXED, to);
+      if (addr == MAP_FAILED)
+        munmap(to, size);
+    }
+  }
+
+  if (addr == MAP_FAILED) {
+    errno = ENOMEM;
+    return (void *)-1;
+  }
+
+  if (addr != m->addr) {
+    *p = m->chain;
+    m->addr = addr;
+    index_add(m);
+  }
+
+  mapped_size = mapped_size - m->size + size;
+  m->size = size;
+  update_peak();
+  return addr;
+}
+
+/*
+ * mem_is_mapped - is the range from lo to hi inside one mapped region
+ */
+int mem_is_mapped(void *lo, void *hi) {
+  for (mapping_t *m = mappings; m != NULL; m = m->next)
+    if ((unsigned char *)lo >= m->addr &&
+        (unsigned char *)hi < m->addr + m->size)
+      return 1;
+
+  return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -73,17 +590,32 @@ void *mem_heap_lo() {
 }
 
 /*
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte, in the segment of the brk
  */
 void *mem_heap_hi() {
-  return (void *)(mem_brk - 1);
+  return (void *)(last->brk - 1);
 }
 
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
 size_t mem_heapsize() {
-  return (size_t)((void *)mem_brk - (void *)heap);
+  return heap_size;
+}
+
+/*
+ * mem_mapsize() - returns the total size of the mapped regions in bytes
+ */
+size_t mem_mapsize() {
+  return mapped_size;
+}
+
+/*
+ * mem_peaksize() - returns the highest heap size plus size of the mapped
+ *    regions since the heap was reset
+ */
+size_t mem_peaksize() {
+  return peak_size;
 }
 
 /*
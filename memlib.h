@@ -1,4 +1,8 @@
-/* DO NOT MODIFY THIS FILE! */
+/*
+ * memlib.h - the memory system under the allocator: a heap grown and shrunk
+ *            at its brk by mem_sbrk on one of the backends below, and
+ *            regions mapped outside of it by mem_map and mem_remap.
+ */
 
 #include <unistd.h>
 
@@ -8,15 +12,40 @@
 #define ALIGNMENT 16
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes, it is only reserved and can be set at
+ * compile time, e.g. -DMAX_HEAP='(64L << 30)'
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (100 * (1 << 20)) /* 100 MB */
+#endif
+
+/*
+ * Backends of the heap, chosen with mem_set_backend before mem_init:
+ * the simulated heap of MAX_HEAP bytes at a fixed address, writable from the
+ * start, a heap of MAX_HEAP bytes reserved anywhere with pages committed as it
+ * grows, and a heap of segments committed the same way and reserved on demand,
+ * which need not be adjacent but lie within MAX_HEAP bytes from the first one
+ */
+#define MEM_SIMULATED 0
+#define MEM_RESERVED 1
+#define MEM_SEGMENTED 2
+#define MEM_HUGE 4 /* added to back the heap by transparent huge pages */
 
+void mem_set_backend(int id);
 void mem_init(void);
 void mem_deinit(void);
 void *mem_sbrk(long incr);
+size_t mem_room(void);
+void *mem_fresh(void);
+void mem_release(void *addr, size_t size);
 void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+void *mem_map(size_t size);
+void mem_unmap(void *addr);
+void *mem_remap(void *addr, size_t size);
+int mem_is_mapped(void *lo, void *hi);
+size_t mem_mapsize(void);
+size_t mem_peaksize(void);
 size_t mem_pagesize(void);
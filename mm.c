@@ -6,6 +6,12 @@
 #include <stddef.h>
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -26,13 +32,49 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define malloc_usable_size mm_malloc_usable_size
 #endif /* def DRIVER */
 
+/* The driver initializes the allocator before every trace, while in place of
+ * the malloc of a process it is initialized by its first call */
+#ifdef DRIVER
+#define LAZY_INIT 0
+#else
+#define LAZY_INIT 1
+#endif
+
 /* Basic constants and macros */
-#define WSIZE 4              /* Word size*/
-#define DSIZE 8              /* Double word size*/
+#ifdef WIDE_HEADERS
+typedef uint64_t word_t;           /* Header, footer and tree priority */
+typedef int64_t link_t;            /* Distance between linked blocks */
+#define WSIZE 8                    /* Word size*/
+#define DSIZE 16                   /* Double word size*/
+#define MIN_BLOCK_SIZE (2 * ALIGNMENT) /* Free block with links and footer */
+#else
+typedef uint32_t word_t;           /* Header, footer and tree priority */
+typedef int32_t link_t;            /* Distance between linked blocks */
+#define WSIZE 4                    /* Word size*/
+#define DSIZE 8                    /* Double word size*/
+#define MIN_BLOCK_SIZE ALIGNMENT   /* Free block with links and footer */
+
+/* Headers hold sizes below 4 GB, which no block of the heap reaches */
+#if MAX_HEAP > (1L << 32)
+#error "MAX_HEAP over 4 GB needs WIDE_HEADERS"
+#endif
+#endif
 #define PSIZE 8              /* Size of pointer in bytes */
-#define CHUNK_SIZE (1 << 12) /* Size of memory chunk*/
+#define CHUNK_SIZE (1 << 12) /* Default size of memory chunk*/
+
+/* Default size of the biggest memory chunk; the driver measures utilization
+ * with a fixed chunk size, while the malloc of a process adapts its growth */
+#ifdef DRIVER
+#define CHUNK_MAX CHUNK_SIZE
+#else
+#define CHUNK_MAX (1 << 20)
+#endif
 
 /* Pack size, allocated bit and previous free bit into a word */
 #define PACK(size, alloc, pfree) ((size) | (alloc) | (pfree))
@@ -42,14 +84,13 @@
 #define DISTANCE_BETWEEN(p1, p2) ((p1 && p2) ? (p1 - p2) / ALIGNMENT : 0)
 
 /* Read a word at address p */
-#define GET(p) (*(unsigned int *)(p)) // read unsigned integer value
-#define GETS(p) (*(int *)(p))         // read signed integer value
+#define GET(p) (*(word_t *)(p))       // read unsigned integer value
+#define GETS(p) (*(link_t *)(p))      // read signed integer value
 #define GETP(p) (*(void **)(p))       // read a pointer
 
 /* Write a word at addres p */
-#define PUT(p, val)                                                            \
-  (*(unsigned int *)(p) = (val))               // write unsigned integer value
-#define PUTS(p, val) (*(int *)(p) = (val))     // write signed integer value
+#define PUT(p, val) (*(word_t *)(p) = (val))   // write unsigned integer value
+#define PUTS(p, val) (*(link_t *)(p) = (val))  // write signed integer value
 #define PUTP(p, pval) (*(void **)(p) = (pval)) // write a pointer
 
 /* Read the size, allocated and previous free fields from address p */
@@ -57,6 +98,14 @@
 #define GET_ALLOC(p) (GET(p) & 0x1)
 #define GET_PFREE(p) (GET(p) & 0x2)
 
+/* Read the field of an allocated block's header at address p, which is set
+ * when the block has been grown by realloc */
+#define GET_GROWN(p) (GET(p) & 0x4)
+#define SET_GROWN(p) PUT(p, GET(p) | 0x4)
+
+/* Write the previous free field at address p, keeping the other fields */
+#define PUT_PFREE(p, pfree) PUT(p, (GET(p) & ~0x2) | (pfree))
+
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp) ((char *)(bp)-WSIZE)
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
@@ -73,6 +122,27 @@
      ? (void *)((char *)(bp) + GETS(PREV_FIELD(bp)) * ALIGNMENT)               \
      : NULL)
 
+/* Given block ptr bp and address p of one of its link fields, read or write
+ * the link as a distance from bp, the same way as the free list fields */
+#define GET_LINK(bp, p)                                                        \
+  (GETS(p) ? (void *)((char *)(bp) + GETS(p) * ALIGNMENT) : NULL)
+#define PUT_LINK(bp, p, lp)                                                    \
+  PUTS(p, DISTANCE_BETWEEN((char *)(lp), (char *)(bp)))
+
+/* Given block ptr bp of a ranged size class, compute address of its left
+ * child, right child, parent and priority fields in the tree, and of the
+ * largest size in its subtree in address ordered trees.
+ * They follow the next and previous free block fields. */
+#define LEFT_FIELD(bp) ((char *)(bp) + 2 * WSIZE)
+#define RIGHT_FIELD(bp) ((char *)(bp) + 3 * WSIZE)
+#define PARENT_FIELD(bp) ((char *)(bp) + 4 * WSIZE)
+#define PRIORITY_FIELD(bp) ((char *)(bp) + 5 * WSIZE)
+#define MAX_FIELD(bp) ((char *)(bp) + 6 * WSIZE)
+
+#define LEFT_BLKP(bp) GET_LINK(bp, LEFT_FIELD(bp))
+#define RIGHT_BLKP(bp) GET_LINK(bp, RIGHT_FIELD(bp))
+#define PARENT_BLKP(bp) GET_LINK(bp, PARENT_FIELD(bp))
+
 /* Add n * PSIZE bytes to void pointer since void pointer arthimetic is illegal
  * and sizeof(void *) = PSIZE */
 #define ADD_VOIDP(p, n) ((void *)((char *)(p) + PSIZE * n))
@@ -86,42 +156,326 @@
 
 /* Round size to ALIGNMENT */
 #define ROUND(size) ((size + ALIGNMENT - 1) & -ALIGNMENT)
-/* Round size to CHUNK_SIZE */
-#define ROUND_MEM(size) ((size + CHUNK_SIZE - 1) & -CHUNK_SIZE)
+/* Size of the block for a request of given size */
+#define BLOCK_SIZE(size)                                                       \
+  ((size) + WSIZE < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : ROUND((size) + WSIZE))
+/* Round size to chunk_size */
+#define ROUND_MEM(size) ((size + chunk_size - 1) & -chunk_size)
+
+/* Size classes of segregated free lists can be set at build time. There are
+ * SINGULAR_BLOCKS_NUM lists of blocks of their own sizes, followed by
+ * RANGED_PER_DOUBLING ranged classes between every two powers of two for
+ * RANGED_DOUBLINGS doublings, and one class of all bigger blocks.
+ * mm_set_classes replaces this layout by one of at most as many singular
+ * classes and at most SFL_SIZE classes in all. */
+#ifndef SINGULAR_BLOCKS_NUM
+#define SINGULAR_BLOCKS_NUM 16
+#endif
+#ifndef RANGED_PER_DOUBLING
+#define RANGED_PER_DOUBLING 4
+#endif
+#ifndef RANGED_DOUBLINGS
+#define RANGED_DOUBLINGS 10
+#endif
 
-#define SINGULAR_BLOCKS_NUM                                                    \
-  16 // Number of free lists with blocks of its own sizes
-#define RANGED_BLOCKS_NUM                                                      \
-  8 // Number of free lists with blocks in a size classes
+/* Number of free lists with blocks in a size classes */
+#define RANGED_BLOCKS_NUM (RANGED_PER_DOUBLING * RANGED_DOUBLINGS + 1)
 
 /* Number of all free lists */
 #define SFL_SIZE (SINGULAR_BLOCKS_NUM + RANGED_BLOCKS_NUM)
 
-/* Number of leading zeros defining limits of size classes in segregated free
- * lists */
-#define LOWEST_LEADING_ZEROS __builtin_clz(256)    // 23 in 32 bit int
-#define HIGHEST_LEADING_ZEROS __builtin_clz(32768) // 16 in 32 bit int
+_Static_assert(SFL_SIZE <= 64, "sfl_bitmap has 64 bits");
+
+/* The table of ranged classes is looked up by the position of the highest bit
+ * of the size and the CLASS_SUB_BITS bits following it */
+#define CLASS_SUB_BITS 3
+#define CLASS_TABLE_SIZE (64 << CLASS_SUB_BITS)
+
+_Static_assert(RANGED_PER_DOUBLING <= 1 << CLASS_SUB_BITS &&
+                 !(RANGED_PER_DOUBLING & (RANGED_PER_DOUBLING - 1)),
+               "ranged classes must split doublings evenly");
+
+/* Is the list of given index one of a ranged size class */
+#define IS_RANGED(index) ((index) >= singular_num)
+
+/* Blocks of the ranged classes must hold the fields of tree nodes */
+#define MIN_SINGULAR_NUM (8 * WSIZE / ALIGNMENT)
+
+/* Policies of the ranged size classes, one is chosen at build time with
+ * -DRANGED_POLICY=<n> */
+#define RANGED_SIZE 0    /* treaps ordered by size, best fit (default) */
+#define RANGED_ADDRESS 1 /* treaps ordered by address, first fit */
+#define RANGED_LIFO 2    /* lists with freed blocks at the front, first fit */
+
+#ifndef RANGED_POLICY
+#define RANGED_POLICY RANGED_SIZE
+#endif
+
+/* Is the list of given index a tree */
+#define IS_TREE(index) (IS_RANGED(index) && RANGED_POLICY != RANGED_LIFO)
+
+#define MAX_ARENAS 64 /* Maximal number of arenas */
+
+/* Built with DEFERRED_COALESCING, freed blocks of the singular sizes are put
+ * onto quick lists of the arena and coalesced only when a request cannot be
+ * satisfied otherwise */
+#ifdef DEFERRED_COALESCING
+#define DEFER_COALESCING 1
+#else
+#define DEFER_COALESCING 0
+#endif
+
+#define PAGE_SHIFT 12                /* Size of page of the page map */
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+
+/* Round size to PAGE_SIZE */
+#define ROUND_PAGE(size) (((size) + PAGE_SIZE - 1) & -PAGE_SIZE)
 
-static char *heap_start;    /* Address of the prologue footer */
-static char *epilogue_blkp; /* Points at epilogue header */
-static void *sfl_start;     /* Adress of first list in segregated free lists*/
+/* Size of the beginning of a region; link to the previous region of the
+ * arena and padding, with the epilogue header at the end */
+#define REGION_OVERHEAD (4 * WSIZE)
+
+/* Given free block ptr bp, is it the last block of the arena ar, which is not
+ * kept in segregated free lists */
+#define IS_WILDERNESS(ar, bp) (HDRP(NEXT_BLKP(bp)) == (ar)->epilogue_blkp)
+
+/* The last block of the arena ar if it is free, else NULL */
+#define WILDERNESS(ar)                                                         \
+  ((ar)->epilogue_blkp && GET_PFREE((ar)->epilogue_blkp)                       \
+     ? (void *)((ar)->epilogue_blkp + WSIZE -                                  \
+                GET_SIZE((ar)->epilogue_blkp - WSIZE))                         \
+     : NULL)
+
+/* Given block ptr bp, compute its index in the page map */
+#define PAGE_INDEX(bp) (((char *)(bp)-heap_lo) >> PAGE_SHIFT)
+
+#define RUN_CLASSES 4                     /* Number of size classes of runs */
+#define RUN_MAX (RUN_CLASSES * ALIGNMENT) /* Largest request served by runs */
+#define RUN_HEADER 64 /* Size of the run header, a multiple of ALIGNMENT */
+#define RUN_SLOTS_MAX ((PAGE_SIZE - RUN_HEADER) / ALIGNMENT)
+#define RUN_FLAG 0x80 /* Set in the page map for a page holding a run */
+
+/* Size of the arena from which runs are used, so that a page of a run is not
+ * a big part of a small heap */
+#define RUN_MIN_HEAP (64 * PAGE_SIZE)
+
+/* Size of the block holding a run; the page starts at the block pointer and
+ * the rest of the block keeps the header of the next block out of the page */
+#define RUN_BLOCK_SIZE (PAGE_SIZE + ALIGNMENT)
+
+/* Given ptr p to a slot, compute address of its run */
+#define RUN_OF(p) ((run_t *)((uintptr_t)(p) & -PAGE_SIZE))
+
+/* Does the page of ptr p hold a run */
+#define IS_RUN(p) (page_map[PAGE_INDEX(p)] & RUN_FLAG)
+
+typedef struct run {
+  struct run *next;            /* Next run of the class with free slots */
+  struct run *prev;            /* Previous run of the class with free slots */
+  uint64_t bitmap[(RUN_SLOTS_MAX + 63) / 64]; /* Bit is set for a free slot */
+  unsigned short slot_size;    /* Size of every slot of the run */
+  unsigned short free_slots;   /* Number of free slots */
+} run_t;
+
+_Static_assert(sizeof(run_t) <= RUN_HEADER, "run header is too big");
+
+typedef struct arena {
+  void *sfl[SFL_SIZE];     /* Segregated free lists */
+  run_t *runs[RUN_CLASSES]; /* Runs with free slots of every size class */
+  void *quick[SINGULAR_BLOCKS_NUM]; /* Freed blocks waiting for coalescing */
+  uint64_t sfl_bitmap;     /* Bit i is set when list i is non-empty */
+  char *epilogue_blkp;     /* Points at epilogue header of the last region */
+  char *last_region;       /* Address of the last region of the arena */
+  size_t heap_size;        /* Size of all regions of the arena */
+  size_t grow_size;        /* Size the heap grew by last time, 0 at first */
+  unsigned long requests;  /* Number of requests served by the arena */
+  unsigned long grow_requests; /* Number of requests when it grew last */
+  char *fresh;             /* The wilderness reads as zeros from here on */
+  void *fresh_blkp;        /* Block carved from there, for calloc */
+  void *remote_frees;      /* Blocks freed by threads of other arenas */
+  int lock;                /* Taken while the arena is used by a thread */
+  int attached;            /* Number of threads using the arena */
+  unsigned char id;        /* Index in arenas array */
+} arena_t;
+
+static arena_t arenas[MAX_ARENAS]; /* arenas[0] is the main arena */
+static int arena_count;            /* Number of initialized arenas */
+static int arenas_lock;            /* Protects attaching threads to arenas */
+static int heap_lock;              /* Protects mem_sbrk and the page map */
+static unsigned int next_shared;   /* Next arena to share if all are taken */
+static pthread_key_t arena_key;    /* Detaches arena when a thread exits */
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+/* Ranged class of sizes by their highest bit and the bits following it */
+static unsigned char class_table[CLASS_TABLE_SIZE];
+static pthread_once_t class_table_once = PTHREAD_ONCE_INIT;
+static pthread_once_t lazy_init_once = PTHREAD_ONCE_INIT;
+
+/* Layout of the size classes, set by mm_set_classes */
+static int singular_num = SINGULAR_BLOCKS_NUM; /* Number of singular lists */
+static int class_num = SFL_SIZE;               /* Number of all lists */
+static size_t class_limits[SFL_SIZE]; /* Biggest block of every ranged class */
+
+static __thread arena_t *thread_arena; /* Arena used by the thread */
+
+#define TCACHE_COUNT 8 /* Maximal number of blocks in a bin of thread cache */
+
+typedef struct tcache {
+  void *bins[SINGULAR_BLOCKS_NUM];             /* Lists of cached blocks */
+  unsigned char counts[SINGULAR_BLOCKS_NUM];   /* Number of blocks in bins */
+} tcache_t;
+
+static __thread tcache_t tcache; /* Cache of small blocks of the thread */
+
+/* Locks are not taken while the process has only one thread */
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 32)
+extern char __libc_single_threaded;
+#define SINGLE_THREADED __libc_single_threaded
+#else
+#define SINGLE_THREADED 0
+#endif
+
+static char *heap_lo; /* Address of the first heap byte */
+
+/* Index of the owning arena of every page of the heap */
+static unsigned char page_map[MAX_HEAP >> PAGE_SHIFT];
+static size_t page_map_used; /* Number of entries set since mm_init */
+
+#define MMAP_THRESHOLD (128 * 1024) /* Default size of mapped requests */
+#define MAPPED_OVERHEAD ALIGNMENT   /* Size of the header of a mapped block */
+
+/* Is block ptr bp in a region mapped outside of the heap */
+#define IS_MAPPED(bp) ((uintptr_t)((char *)(bp)-heap_lo) >= MAX_HEAP)
+
+/* Given block ptr bp of a mapped block, read the size of its region from the
+ * header on, and the size of the lead in front of the header, which aligned
+ * blocks have */
+#define MAPPED_SIZE(bp) (*(size_t *)((char *)(bp)-MAPPED_OVERHEAD))
+#define MAPPED_LEAD(bp) (*(size_t *)((char *)(bp)-sizeof(size_t)))
+
+static size_t mmap_threshold = MMAP_THRESHOLD; /* Set by mm_mallopt */
+
+/* Bump arena: blocks bump allocated from chunks of the heap, freed at once */
+struct mm_bump {
+  void *chunks;      /* Chunks linked by their first word, the current first */
+  char *ptr;         /* First free byte of the current chunk */
+  char *end;         /* End of the current chunk */
+  size_t chunk_size; /* Size of the chunks taken from the heap */
+};
+
+#define BUMP_CHUNK_SIZE (64 * 1024) /* Default size of chunks of bump arenas */
+#define BUMP_CHUNK_HEADER ALIGNMENT /* Link to the next chunk, padded */
+#define BUMP_FREE_BATCH 64          /* Chunks given to one mm_free_batch */
+
+/* calloc looks for zeroed memory for requests of at least this size, and zeroes
+ * blocks of at least ZERO_STREAM_MIN bytes with non-temporal stores */
+#define CALLOC_FRESH_MIN 1024
+#define ZERO_STREAM_MIN (256 * 1024)
+
+/* Free blocks of every list tried for one which holds an aligned block, before
+ * a block big enough for any placement is taken */
+#define ALIGNED_SCAN 16
+
+#define TRIM_THRESHOLD (128 * 1024) /* Default size of free top to release */
+
+static size_t trim_threshold = TRIM_THRESHOLD; /* Set by mm_mallopt */
+
+static size_t chunk_size = CHUNK_SIZE; /* Set by mm_mallopt */
+static size_t chunk_max = CHUNK_MAX;   /* Set by mm_mallopt */
+
+/* The heap grows faster while at least this many bytes are taken from it on
+ * average by every request */
+#define GROW_RATE ALIGNMENT
+
+/* Size of the fields at the beginning of a free block, which are kept when
+ * its pages are released */
+#define FREE_FIELDS_SIZE (7 * WSIZE)
+
+/* A block grown by realloc again gets free space behind it of this part of its
+ * size, but at most this part of the size of its arena */
+#define GROW_SLACK_SHIFT 1
+#define GROW_SLACK_HEAP_SHIFT 3
 
 /*
  * Memory allocator utilizes segregated free list technique.
  * free blocks ranging in size from 16 to 256 bytes are put into their own lists
-and the rest is put into power of two size classes.
+and the rest is put into size classes, four between every two powers of two.
  *
  * Headers and footers store information about size and allocation of the block
 and whether the previous block is free.
- * Headers and footers are unsigned integers and take 4 bytes.
+ * Headers and footers are unsigned integers and take 4 bytes, or 8 bytes when
+ * built with WIDE_HEADERS for heaps and blocks over 4 GB.
  *
  * Allocated blocks only have headers.
  * Free blocks have headers, footers and store information
  * about the next and previous free blocks in the list
  *
- * The next free block and previous free block field are signed integers and
- * indicate the distance between the blocks with one unit being equal to
-ALIGNMENT.
+ * The next free block and previous free block field are signed integers of the
+ * same size and indicate the distance between the blocks with one unit being
+ * equal to ALIGNMENT.
+ *
+ * Blocks of the ranged size classes are kept in treaps ordered by size.
+ * Every node of a treap is the first block of a list of free blocks of the
+ * same size. Such blocks store left child, right child and parent links
+ * encoded in the same way as the list links after the list fields, followed
+ * by the priority of the node. Thanks to that the best fit is found in
+ * logarithmic time and blocks of the same size are added and removed in
+ * constant time.
+ * Built with RANGED_POLICY set to RANGED_ADDRESS the treaps are ordered by
+ * address instead and every node stores the largest size in its subtree, so
+ * the first fit in address order is found in logarithmic time. With
+ * RANGED_LIFO the ranged classes are plain lists searched for the first fit.
+ *
+ * Free lists live in arenas. Each thread is attached to an arena on its first
+ * malloc, a new one if there are less than MAX_ARENAS of them, else the one
+ * which is not used at the moment is shared. Every arena has its own lock and
+ * consists of regions of the heap, each ending with an epilogue header.
+ * If an arena is at the top of the heap, its last region is extended,
+ * otherwise a new region is started at a page boundary. The page map stores
+ * the owning arena of every page, so free() knows which arena to free to.
+ * A block freed by a thread of another arena does not take the lock. It is
+ * pushed onto the list of remote frees of the owning arena with a single
+ * compare and swap, and the whole list is taken and freed by the owner on its
+ * next malloc, which needs the lock anyway.
+ *
+ * In front of the singular lists every thread has a cache of freed small
+ * blocks. Cached blocks stay marked as allocated, so they are returned by
+ * malloc and put back by free without touching any other block or taking a
+ * lock. When a bin of the cache is full, half of it is freed to the arenas
+ * owning the blocks. Blocks followed by a free block are not cached, so they
+ * are coalesced, and blocks of an arena are released from the cache before
+ * its heap grows. The cache is used only in a multi-threaded process, since
+ * otherwise the arena is not locked and the cache only adds fragmentation.
+ *
+ * Requests of at least mmap_threshold bytes get regions mapped outside of the
+ * heap. A mapped block starts with the size of its region and the region is
+ * unmapped by free() and remapped by realloc(), so the memory is returned.
+ *
+ * When a free block of at least trim_threshold bytes ends the arena at the top
+ * of the heap, the heap is shrunk instead of adding the block to the free
+ * lists. mm_trim() gives back the pages inside large free blocks.
+ *
+ * The free block ending the last region of an arena is its wilderness. It is
+ * not kept in the free lists, so coalescing with it and extending it is cheap.
+ * When no block in the lists fits, the request is carved from the front of the
+ * wilderness, which is extended by growing the heap when it is too small.
+ *
+ * With DEFERRED_COALESCING freed blocks of the singular sizes stay marked as
+ * allocated on quick lists of the arena, from which requests of the same size
+ * are served first. They are coalesced all at once when a request fits neither
+ * a free block nor the wilderness, before the heap is increased.
+ *
+ * A block which realloc() grows for the second time is marked in its header
+ * and is given free space behind it, so the following growths are done in
+ * place. The space is half of the block, limited to an eighth of the arena,
+ * and stays in the free lists, so it is used by malloc when needed.
+ *
+ * Once an arena has RUN_MIN_HEAP bytes, requests of at most RUN_MAX bytes are
+ * served from runs. A run is a page aligned block holding a header with a
+ * bitmap of free slots, followed by slots of one size without headers. Pages
+ * of runs are flagged in the page map, so free() finds the run by masking the
+ * pointer. Every arena keeps a list of runs with free slots per size class and
+ * a run without used slots is freed, unless it is the last one of its class.
  *
  *  Free block structure:
  *
@@ -144,453 +498,2792 @@ ALIGNMENT.
  *  First, algorithm tries to find a sufficiently sized block with find_block()
 function. If it finds a good block it splits it if needed and returns pointer to
 the block of desired size. If a free block of asked size or larger is not found
-in the segregated free list, heap is increased by CHUNK_SIZE. Then the chunk is
-split if needed and pointer to a block of requested size is returned. If a block
-was split, the free part is added to the segregated free list.
+in the segregated free list, the block is carved from the front of the
+wilderness, the free block at the end of the arena which is kept out of the
+lists. If the wilderness is too small, heap is increased by a multiple of
+chunk_size and the new memory extends the wilderness. Whatever is left behind
+the carved block stays the wilderness.
  *
  *  Freeing memory:
  *  Freeing is straightforward. Block is marked as free in header and footer is
 added. Previous block field is changed in the next block. The newly freed block
 is then coalesced with adjoining blocks if possible. Finally, the block is added
-to the segregated free list.
+to the segregated free list, unless it was merged into the wilderness.
  *
  */
 
 /*
  * find_index - depending on size find index of list that stores blocks of that
- * size It utilizes the count leading zeros function to determine which range
- * given size falls into.
+ * size. Sizes of the ranged classes are looked up in the class table.
  */
 
 static inline int find_index(size_t size) {
 
-  if (size <= SINGULAR_BLOCKS_NUM * ALIGNMENT) {
+  if (size <= (size_t)singular_num * ALIGNMENT) {
     return (size / ALIGNMENT) - 1;
   }
 
-  int leading_zeros = __builtin_clz(size);
-
-  if (leading_zeros <= HIGHEST_LEADING_ZEROS) {
-    return SFL_SIZE - 1;
-  }
+  size_t x = size - 1;
+  int lg = 63 - __builtin_clzl(x);
 
-  return LOWEST_LEADING_ZEROS - leading_zeros + SINGULAR_BLOCKS_NUM;
+  return class_table[lg << CLASS_SUB_BITS |
+                     ((x >> (lg - CLASS_SUB_BITS)) &
+                      ((1 << CLASS_SUB_BITS) - 1))];
 }
 
 /*
- * add_to_sfl - Add block to segregated free list
+ * class_limit - Size of the biggest block of the ranged class of given index
+ * in the layout set at build time
  */
-static inline void add_to_sfl(void *ptr) {
+static size_t class_limit(int index) {
 
-  size_t size = GET_SIZE(HDRP(ptr));
-  int index = find_index(size);
-  void *first_blkp = ADD_VOIDP(sfl_start, index);
+  int ranged = index - SINGULAR_BLOCKS_NUM;
 
-  int distance = DISTANCE_BETWEEN(GETP(first_blkp), ptr);
+  if (ranged == RANGED_BLOCKS_NUM - 1) {
+    return SIZE_MAX;
+  }
 
-  PUTS(ptr, distance);
-  PUTS(PREV_FIELD(ptr), 0);
+  size_t low = (size_t)SINGULAR_BLOCKS_NUM * ALIGNMENT
+               << (ranged / RANGED_PER_DOUBLING);
 
-  /* if there is a block in the list assign the pointer ptr to its previous
-   * block field */
-  if (GETP(first_blkp)) {
-    PUTS(PREV_FIELD(GETP(first_blkp)), -distance);
-  }
-  PUTP(first_blkp, ptr); // assign ptr as the new first block in list
+  return low + low / RANGED_PER_DOUBLING * (ranged % RANGED_PER_DOUBLING + 1);
 }
 
 /*
- * remove_from_sfl - Remove block from segregated free list
- * Index to the segregated free list can be passed.
+ * class_round - Round block size up to the biggest size of its entry in the
+ * class table, the sizes by which classes can be told apart
  */
-static inline void remove_from_sfl(void *ptr, int index) {
-
-  if (ptr == NULL) {
-    return;
-  }
-
-  void *next_free_blkp = NEXT_FREE_BLKP(ptr);
-  void *prev_free_blkp = PREV_FREE_BLKP(ptr);
-  int distance = DISTANCE_BETWEEN(next_free_blkp, prev_free_blkp);
+static size_t class_round(size_t size) {
 
-  if (prev_free_blkp) {
-    PUTS(prev_free_blkp, distance);
-  } else { // if ptr was the first block we assign the next block as the
-           // beginning of list
-    if (index < 0) {
-      index = find_index(GET_SIZE(HDRP(ptr)));
-    }
+  size_t x = size - 1;
+  int lg = 63 - __builtin_clzl(x);
 
-    PUTP(ADD_VOIDP(sfl_start, index), next_free_blkp);
+  if (lg < CLASS_SUB_BITS) {
+    return size;
   }
 
-  if (next_free_blkp) {
-    PUTS(PREV_FIELD(next_free_blkp), -distance);
-  }
+  return (x | (((size_t)1 << (lg - CLASS_SUB_BITS)) - 1)) + 1;
 }
 
 /*
- * find_block - Find a block with enough size.
- * If the size is smaller or equal than SINGULAR_BLOCKS_NUM * ALIGNMENT then it
- * just returns the first block in the list. Else it tries to find the best fit
- * for the block in the list determined by find_size function.
+ * class_table_fill - Fill the class table from class_limits. All sizes of an
+ * entry go to the class of the biggest of them, so the classes of sizes never
+ * decrease.
  */
+static void class_table_fill(void) {
 
-static inline void *find_block(size_t size) {
+  int index = singular_num;
 
-  int index = find_index(size); // smallest index that may fit the block
-  void *new_block_ptr = GETP(ADD_VOIDP(sfl_start, index));
+  for (int key = 0; key < CLASS_TABLE_SIZE; ++key) {
 
-  if (new_block_ptr) {
-    if (GET_SIZE(HDRP(new_block_ptr)) == size) {
-      return new_block_ptr;
-    }
-  } else {
-    index++;
-  }
+    int lg = key >> CLASS_SUB_BITS;
+    int sub = key & ((1 << CLASS_SUB_BITS) - 1);
 
-  for (; index < SFL_SIZE; ++index) {
+    if (lg < CLASS_SUB_BITS) {
+      continue;
+    }
 
-    new_block_ptr = GETP(ADD_VOIDP(sfl_start, index));
+    /* biggest size of the entry, or all sizes left when it overflows */
+    size_t size = lg - CLASS_SUB_BITS < 64 - CLASS_SUB_BITS - 1
+                    ? (size_t)((1 << CLASS_SUB_BITS) + sub + 1)
+                        << (lg - CLASS_SUB_BITS)
+                    : SIZE_MAX;
 
-    if (!new_block_ptr) { // if there is no blocks in the list continue
-      continue;
+    while (class_limits[index] < size) {
+      index++;
     }
 
-    int min_diff = INT_MAX;
-    void *min_ptr = NULL;
+    class_table[key] = index;
+  }
+}
 
-    while (new_block_ptr) {
-      int diff = GET_SIZE(HDRP(new_block_ptr)) - size; // diff can be negative
+/*
+ * class_table_init - Fill the class table with the layout set at build time
+ */
+static void class_table_init(void) {
 
-      if (diff > 0 && diff < min_diff) {
-        min_diff = diff;
-        min_ptr = new_block_ptr;
+  for (int i = SINGULAR_BLOCKS_NUM; i < SFL_SIZE; ++i) {
+    class_limits[i] = class_limit(i);
+  }
 
-      } else if (diff == 0) { // if block has perfect size return it
-        return new_block_ptr;
-      }
+  class_table_fill();
+}
 
-      new_block_ptr = NEXT_FREE_BLKP(new_block_ptr);
-    }
+/*
+ * tree_priority - Treap priority of a new tree node, a hash of its address
+ */
+static inline unsigned int tree_priority(void *ptr) {
 
-    /* if none of the blocks in the list are sufficient size, continue */
-    if (!min_ptr) {
-      continue;
-    }
+  unsigned int x = (uintptr_t)ptr / ALIGNMENT;
 
-    return min_ptr;
-  }
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
 
-  return NULL;
+  return x;
 }
 
 /*
- * split - Split given block if needed; returns pointer to the free block of
- * desired size. It does the splitting abnormally so that the first block is the
- * one to remain free and the second is the one to which the pointer is
- * returned.
+ * tree_replace - Put new_ptr in place of child ptr of parent. If parent is
+ * NULL then ptr is the root and root field of the tree is changed instead.
  */
-static inline void *split(void *ptr, size_t size) {
+static inline void tree_replace(void *root, void *parent, void *ptr,
+                                void *new_ptr) {
 
-  size_t ptr_size = GET_SIZE(HDRP(ptr));
-  int diff = ptr_size - size;
+  if (!parent) {
+    PUTP(root, new_ptr);
+  } else if (LEFT_BLKP(parent) == ptr) {
+    PUT_LINK(parent, LEFT_FIELD(parent), new_ptr);
+  } else {
+    PUT_LINK(parent, RIGHT_FIELD(parent), new_ptr);
+  }
 
-  if (diff < ALIGNMENT) { // minimal size requirement
-    return ptr;
-  } else if (size == 0) {
-    return ptr;
+  if (new_ptr) {
+    PUT_LINK(new_ptr, PARENT_FIELD(new_ptr), parent);
   }
+}
 
-  size_t pfree = GET_PFREE(HDRP(ptr));
+/*
+ * tree_update - Store the largest size in the subtree of node ptr of an
+ * address ordered tree
+ */
+static inline void tree_update(void *ptr) {
 
-  // free block
-  PUT(HDRP(ptr), PACK(diff, 0, pfree));
-  PUT(FTRP(ptr), PACK(diff, 0, pfree));
+  size_t max = GET_SIZE(HDRP(ptr));
+  void *child;
 
-  // soon to be allocated block
-  void *next_blkp = NEXT_BLKP(ptr);
-  PUT(HDRP(next_blkp), PACK(size, 0, 2));
-  PUT(FTRP(next_blkp), PACK(size, 0, 2));
+  if ((child = LEFT_BLKP(ptr)) && GET(MAX_FIELD(child)) > max) {
+    max = GET(MAX_FIELD(child));
+  }
+  if ((child = RIGHT_BLKP(ptr)) && GET(MAX_FIELD(child)) > max) {
+    max = GET(MAX_FIELD(child));
+  }
 
-  return next_blkp;
+  PUT(MAX_FIELD(ptr), max);
 }
 
 /*
- * coalesce_front - Possibly coalesce the block in the front
+ * tree_update_path - Update the largest sizes from node ptr up to the root,
+ * after the size of the block changed or a block below was removed
  */
-static void *coalesce_front(void *ptr) {
+static inline void tree_update_path(void *ptr) {
 
-  size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(ptr)));
-  size_t size = GET_SIZE(HDRP(ptr));
+  if (RANGED_POLICY != RANGED_ADDRESS) {
+    return;
+  }
 
-  if (!next_alloc) { // next block is free
+  for (; ptr; ptr = PARENT_BLKP(ptr)) {
+    tree_update(ptr);
+  }
+}
 
-    void *next_blkp = NEXT_BLKP(ptr);
-    size_t next_size = GET_SIZE(HDRP(next_blkp));
+/*
+ * tree_rotate_up - Rotate node ptr above its parent
+ */
+static void tree_rotate_up(void *root, void *ptr) {
 
-    remove_from_sfl(next_blkp, -1);
+  void *parent = PARENT_BLKP(ptr);
+  void *child;
 
-    size += next_size;
+  tree_replace(root, PARENT_BLKP(parent), parent, ptr);
 
-    size_t pfree = GET_PFREE(HDRP(ptr));
+  if (LEFT_BLKP(parent) == ptr) {
+    child = RIGHT_BLKP(ptr);
+    PUT_LINK(parent, LEFT_FIELD(parent), child);
+    PUT_LINK(ptr, RIGHT_FIELD(ptr), parent);
+  } else {
+    child = LEFT_BLKP(ptr);
+    PUT_LINK(parent, RIGHT_FIELD(parent), child);
+    PUT_LINK(ptr, LEFT_FIELD(ptr), parent);
+  }
 
-    PUT(HDRP(ptr), PACK(size, 0, pfree));
-    PUT(FTRP(next_blkp), PACK(size, 0, pfree));
+  PUT_LINK(parent, PARENT_FIELD(parent), ptr);
+
+  if (child) {
+    PUT_LINK(child, PARENT_FIELD(child), parent);
   }
 
-  return ptr;
+  if (RANGED_POLICY == RANGED_ADDRESS) {
+    tree_update(parent);
+    tree_update(ptr);
+  }
 }
 
 /*
- * coalesce_back - Possibly coalesce the block in the back.
+ * tree_insert - Insert block into the tree which root is stored at root.
+ * If there is a node of the same size the block is added to its list,
+ * else the block becomes a new node. In address ordered trees every block is
+ * a node.
  */
-static void *coalesce_back(void *ptr) {
+static void tree_insert(void *root, void *ptr) {
 
-  size_t prev_alloc = !GET_PFREE(HDRP(ptr));
   size_t size = GET_SIZE(HDRP(ptr));
+  void *parent = NULL;
+  void *node = GETP(root);
+  bool left = false;
 
-  if (!prev_alloc) {
+  while (node && RANGED_POLICY == RANGED_ADDRESS) {
+    if (GET(MAX_FIELD(node)) < size) {
+      PUT(MAX_FIELD(node), size);
+    }
 
-    void *prev_blkp = PREV_BLKP(ptr);
-    size_t prev_size = GET_SIZE(HDRP(prev_blkp));
+    parent = node;
+    left = (char *)ptr < (char *)node;
+    node = left ? LEFT_BLKP(node) : RIGHT_BLKP(node);
+  }
 
-    remove_from_sfl(prev_blkp, -1);
+  while (node) {
+    size_t node_size = GET_SIZE(HDRP(node));
 
-    size += prev_size;
+    if (node_size == size) { // add block right after the node
+      void *next = NEXT_FREE_BLKP(node);
 
-    size_t pfree = GET_PFREE(HDRP(prev_blkp));
+      PUT_LINK(ptr, ptr, next);
+      PUT_LINK(ptr, PREV_FIELD(ptr), node);
+      PUT_LINK(node, node, ptr);
 
-    PUT(HDRP(prev_blkp), PACK(size, 0, pfree));
-    PUT(FTRP(ptr), PACK(size, 0, pfree));
+      if (next) {
+        PUT_LINK(next, PREV_FIELD(next), ptr);
+      }
+      return;
+    }
 
-    return prev_blkp;
+    parent = node;
+    left = size < node_size;
+    node = left ? LEFT_BLKP(node) : RIGHT_BLKP(node);
   }
 
-  return ptr;
+  unsigned int priority = tree_priority(ptr);
+
+  PUTS(ptr, 0);
+  PUTS(PREV_FIELD(ptr), 0);
+  PUTS(LEFT_FIELD(ptr), 0);
+  PUTS(RIGHT_FIELD(ptr), 0);
+  PUT(PRIORITY_FIELD(ptr), priority);
+  PUT(MAX_FIELD(ptr), size);
+
+  if (!parent) {
+    PUTP(root, ptr);
+    PUTS(PARENT_FIELD(ptr), 0);
+    return;
+  }
+
+  if (left) {
+    PUT_LINK(parent, LEFT_FIELD(parent), ptr);
+  } else {
+    PUT_LINK(parent, RIGHT_FIELD(parent), ptr);
+  }
+  PUT_LINK(ptr, PARENT_FIELD(ptr), parent);
+
+  /* restore heap order of priorities */
+  while ((parent = PARENT_BLKP(ptr)) && GET(PRIORITY_FIELD(parent)) < priority) {
+    tree_rotate_up(root, ptr);
+  }
 }
 
 /*
- * mm_init - Called when a new trace starts.
+ * tree_remove - Remove block from the tree which root is stored at root.
+ * Blocks from the lists of nodes are just unlinked. A node with a list is
+ * replaced by the next block in the list. Otherwise the node is rotated down
+ * until it has at most one child and then it is replaced by that child.
  */
-int mm_init(void) {
+static void tree_remove(void *root, void *ptr) {
 
-  heap_start = mem_sbrk(PSIZE * SFL_SIZE + WSIZE + 3 * WSIZE);
+  void *next = NEXT_FREE_BLKP(ptr);
+  void *prev = PREV_FREE_BLKP(ptr);
 
-  /* SFL_SIZE is number of segregated free lists.
-   * PSIZE * SFL_SIZE for segregated free lists array
-   * WSIZE for alignment padding
-   * 3 * WSIZE for prologue header, prologue footer and epilogue header
-   */
+  if (prev) {
+    PUT_LINK(prev, prev, next);
 
-  if (heap_start < 0) {
-    return -1;
+    if (next) {
+      PUT_LINK(next, PREV_FIELD(next), prev);
+    }
+    return;
   }
 
-  sfl_start = (void *)heap_start;
+  void *left = LEFT_BLKP(ptr);
+  void *right = RIGHT_BLKP(ptr);
 
-  /* Segregated free lists array */
-  for (int i = 0; i < SFL_SIZE; ++i) {
-    PUTP(ADD_VOIDP(sfl_start, i), NULL);
-  }
+  if (next) {
+    tree_replace(root, PARENT_BLKP(ptr), ptr, next);
+    PUTS(PREV_FIELD(next), 0);
+    PUT_LINK(next, LEFT_FIELD(next), left);
+    PUT_LINK(next, RIGHT_FIELD(next), right);
+    PUT(PRIORITY_FIELD(next), GET(PRIORITY_FIELD(ptr)));
 
-  heap_start += SFL_SIZE * PSIZE;
+    if (left) {
+      PUT_LINK(left, PARENT_FIELD(left), next);
+    }
+    if (right) {
+      PUT_LINK(right, PARENT_FIELD(right), next);
+    }
+    return;
+  }
 
-  /* Alignment padding */
-  PUT(heap_start, 0);
+  while (left && right) {
+    if (GET(PRIORITY_FIELD(left)) > GET(PRIORITY_FIELD(right))) {
+      tree_rotate_up(root, left);
+    } else {
+      tree_rotate_up(root, right);
+    }
+    left = LEFT_BLKP(ptr);
+    right = RIGHT_BLKP(ptr);
+  }
 
-  PUT(heap_start + (1 * WSIZE), PACK(WSIZE, 1, 0)); /* Prologue header */
-  PUT(heap_start + (2 * WSIZE), PACK(WSIZE, 1, 0)); /* Prologue footer */
-  PUT(heap_start + (3 * WSIZE), PACK(0, 1, 0));     /* Epilogue header */
-  heap_start += (2 * WSIZE);
-  epilogue_blkp = heap_start + WSIZE;
-  PUT(epilogue_blkp, PACK(0, 1, 0));
+  void *parent = PARENT_BLKP(ptr);
 
-  return 0;
+  tree_replace(root, parent, ptr, left ? left : right);
+  tree_update_path(parent);
 }
 
 /*
- * malloc - Allocate a block by finding a free one in segregated free lists or
- * by allocating a chunk of size CHUNK_SIZE and then splitting it if necessary.
- * Always allocate a block which size is a multiple of ALIGNMENT
+ * tree_find - Find the best fitting block in the tree, that is a block from
+ * the node with the smallest size that is not less than given size. The block
+ * following the node is preferred since it is removed in constant time.
+ * In address ordered trees the first big enough block is found.
  */
-void *malloc(size_t size) {
+static inline void *tree_find(void *node, size_t size) {
 
-  size = (size + WSIZE < ALIGNMENT) ? ALIGNMENT : ROUND(size + WSIZE);
+  /* the first fit is in the leftmost subtree with a big enough block */
+  while (node && RANGED_POLICY == RANGED_ADDRESS) {
+    void *left = LEFT_BLKP(node);
+    void *right = RIGHT_BLKP(node);
 
-  void *free_blkp = find_block(size);
-
-  /* free block in the sfl is found */
-  if (free_blkp) {
+    if (left && GET(MAX_FIELD(left)) >= size) {
+      node = left;
+    } else if (GET_SIZE(HDRP(node)) >= size) {
+      return node;
+    } else {
+      node = right && GET(MAX_FIELD(right)) >= size ? right : NULL;
+    }
+  }
 
-    size_t old_size = GET_SIZE(HDRP(free_blkp));
-    void *split_blkp = split(free_blkp, size);
-    int old_size_index = find_index(old_size);
+  void *best = NULL;
 
-    /* remove the block from sfl if the found block is perfect size or when
-     * splitting the block resulted in moving it to another size class */
-    if (split_blkp == free_blkp ||
-        (find_index(old_size - size) != old_size_index)) {
-      remove_from_sfl(free_blkp, old_size_index);
+  while (node) {
+    size_t node_size = GET_SIZE(HDRP(node));
 
-      /* add split block back to sfl */
-      if (split_blkp != free_blkp) {
-        add_to_sfl(free_blkp);
-      }
+    if (node_size == size) { // if block has perfect size return it
+      best = node;
+      break;
+    } else if (node_size > size) {
+      best = node;
+      node = LEFT_BLKP(node);
+    } else {
+      node = RIGHT_BLKP(node);
     }
-
-    /* marking the block as allocated */
-    PUT(HDRP(split_blkp), PACK(size, 1, GET_PFREE(HDRP(split_blkp))));
-
-    void *next_blkh = HDRP(NEXT_BLKP(split_blkp));
-    PUT(next_blkh, PACK(GET_SIZE(next_blkh), GET_ALLOC(next_blkh), 0));
-    return split_blkp;
   }
 
-  /* Suitable block was not found in the segregated free lists so increasing the
-   * heap */
-  size_t mem_incr = ROUND_MEM(size);
-  free_blkp = mem_sbrk(mem_incr);
+  if (best && NEXT_FREE_BLKP(best)) {
+    return NEXT_FREE_BLKP(best);
+  }
 
-  size_t pfree = GET_PFREE(epilogue_blkp);
+  return best;
+}
 
-  PUT(HDRP(free_blkp), PACK(mem_incr, 0, pfree));
+/*
+ * tree_first - Return the first node in order of the subtree
+ */
+static inline void *tree_first(void *node) {
 
-  void *split_blkp = split(free_blkp, size);
+  void *left;
 
-  /* If block was split add the remaining part to the sfl */
-  if (split_blkp != free_blkp) {
-    add_to_sfl(free_blkp);
-    PUT(HDRP(split_blkp), PACK(size, 1, 2));
-  } else {
-    PUT(HDRP(split_blkp), PACK(size, 1, pfree));
+  while (node && (left = LEFT_BLKP(node))) {
+    node = left;
   }
 
-  /* Move epilogue header */
-  epilogue_blkp += mem_incr;
-  PUT(epilogue_blkp, PACK(0, 1, 0)); // new epilogue header
-
-  return split_blkp;
+  return node;
 }
 
 /*
- * free - Free a block, coalesce if possible and add it to segregated free list
+ * tree_next - Return the node following ptr in the tree order
  */
-void free(void *ptr) {
+static inline void *tree_next(void *ptr) {
 
-  if (ptr == NULL) {
-    return;
-  }
+  void *right = RIGHT_BLKP(ptr);
 
-  size_t size = GET_SIZE(HDRP(ptr));
-  size_t pfree = GET_PFREE(HDRP(ptr));
+  if (right) {
+    return tree_first(right);
+  }
 
-  PUT(HDRP(ptr), PACK(size, 0, pfree));
-  PUT(FTRP(ptr), PACK(size, 0, pfree));
+  void *parent = PARENT_BLKP(ptr);
 
-  void *next_blkh = HDRP(NEXT_BLKP(ptr));
-  /* switching previous free bit in the next block */
-  PUT(next_blkh, PACK(GET_SIZE(next_blkh), GET_ALLOC(next_blkh), 2));
+  while (parent && RIGHT_BLKP(parent) == ptr) {
+    ptr = parent;
+    parent = PARENT_BLKP(ptr);
+  }
 
-  coalesce_front(ptr);
-  ptr = coalesce_back(ptr);
-  add_to_sfl(ptr);
+  return parent;
 }
 
 /*
- * realloc - Change the size of the block by coalescing block in the front
- * or by calling malloc and copying the data.
+ * tree_in_order - Check if block is a node without a list which would still
+ * follow its predecessor if its size was decreased to given size, so it can
+ * stay in its place in the tree. Blocks of address ordered trees and of the
+ * ranged lists always stay.
  */
-void *realloc(void *old_ptr, size_t size) {
-  /* If size == 0 then this is just free, and we return NULL. */
-  if (size == 0) {
-    free(old_ptr);
-    return NULL;
-  }
-
-  /* If old_ptr is NULL, then this is just malloc. */
-  if (!old_ptr)
-    return malloc(size);
+static inline bool tree_in_order(void *ptr, size_t size) {
 
-  size_t old_size = GET_SIZE(HDRP(old_ptr));
-  size_t r_size = ROUND(size + WSIZE);
+  if (RANGED_POLICY != RANGED_SIZE) {
+    return true;
+  }
 
-  /* If the requested size is smaller or equal than the currently allocated */
-  if (old_size == r_size) {
-    return old_ptr;
-  } else if (old_size > r_size) {
+  if (GETS(ptr) || GETS(PREV_FIELD(ptr))) {
+    return false;
+  }
 
-    PUT(HDRP(old_ptr), PACK(r_size, 1, GET_PFREE(HDRP(old_ptr))));
+  void *prev = LEFT_BLKP(ptr);
 
-    void *next_blkp = NEXT_BLKP(old_ptr);
-    PUT(HDRP(next_blkp), PACK(old_size - r_size, 0, 0));
-    PUT(FTRP(next_blkp), PACK(old_size - r_size, 0, 0));
+  if (prev) {
+    void *right;
 
-    add_to_sfl(next_blkp);
+    while ((right = RIGHT_BLKP(prev))) {
+      prev = right;
+    }
+  } else {
+    void *node = ptr;
+    prev = PARENT_BLKP(node);
 
-    return old_ptr;
+    while (prev && LEFT_BLKP(prev) == node) {
+      node = prev;
+      prev = PARENT_BLKP(node);
+    }
+  }
+
+  return !prev || GET_SIZE(HDRP(prev)) < size;
+}
+
+/*
+ * add_to_sfl - Add block to segregated free list
+ */
+static inline void add_to_sfl(arena_t *ar, void *ptr) {
+
+  size_t size = GET_SIZE(HDRP(ptr));
+  int index = find_index(size);
+  void *first_blkp = ADD_VOIDP(ar->sfl, index);
+
+  ar->sfl_bitmap |= 1ull << index;
+
+  if (IS_TREE(index)) {
+    tree_insert(first_blkp, ptr);
+    return;
+  }
+
+  link_t distance = DISTANCE_BETWEEN(GETP(first_blkp), ptr);
+
+  PUTS(ptr, distance);
+  PUTS(PREV_FIELD(ptr), 0);
+
+  /* if there is a block in the list assign the pointer ptr to its previous
+   * block field */
+  if (GETP(first_blkp)) {
+    PUTS(PREV_FIELD(GETP(first_blkp)), -distance);
+  }
+  PUTP(first_blkp, ptr); // assign ptr as the new first block in list
+}
+
+/*
+ * remove_from_sfl - Remove block from segregated free list
+ * Index to the segregated free list can be passed.
+ */
+static inline void remove_from_sfl(arena_t *ar, void *ptr, int index) {
+
+  if (ptr == NULL) {
+    return;
+  }
+
+  if (index < 0) {
+    index = find_index(GET_SIZE(HDRP(ptr)));
+  }
+
+  void *first_blkp = ADD_VOIDP(ar->sfl, index);
+
+  if (IS_TREE(index)) {
+    tree_remove(first_blkp, ptr);
+
+    if (!GETP(first_blkp)) { // tree became empty
+      ar->sfl_bitmap &= ~(1ull << index);
+    }
+    return;
+  }
+
+  void *next_free_blkp = NEXT_FREE_BLKP(ptr);
+  void *prev_free_blkp = PREV_FREE_BLKP(ptr);
+  link_t distance = DISTANCE_BETWEEN(next_free_blkp, prev_free_blkp);
+
+  if (prev_free_blkp) {
+    PUTS(prev_free_blkp, distance);
+  } else { // if ptr was the first block we assign the next block as the
+           // beginning of list
+    PUTP(first_blkp, next_free_blkp);
+
+    if (!next_free_blkp) { // list became empty
+      ar->sfl_bitmap &= ~(1ull << index);
+    }
+  }
+
+  if (next_free_blkp) {
+    PUTS(PREV_FIELD(next_free_blkp), -distance);
+  }
+}
+
+/*
+ * unlink_free - Take free block out of segregated free lists, unless it is the
+ * wilderness, which is not in them
+ */
+static inline void unlink_free(arena_t *ar, void *ptr) {
+
+  if (!IS_WILDERNESS(ar, ptr)) {
+    remove_from_sfl(ar, ptr, -1);
+  }
+}
+
+/*
+ * find_block - Find a block with enough size.
+ * If the size fits one of the singular lists then it just returns the first
+ * block in the list. Else it finds the best fit for the block in the tree of
+ * the size class determined by find_index function, or the first fit with the
+ * other policies of the ranged classes.
+ * Lists are visited in the order given by sfl_bitmap, so empty lists are
+ * skipped with a single count trailing zeros instruction.
+ */
+
+static inline void *find_block(arena_t *ar, size_t size) {
+
+  int index = find_index(size); // smallest index that may fit the block
+
+  /* non-empty lists with index greater or equal than the smallest one */
+  uint64_t lists = ar->sfl_bitmap & (~0ull << index);
+
+  for (; lists; lists &= lists - 1) {
+
+    index = __builtin_ctzll(lists);
+    void *new_block_ptr = GETP(ADD_VOIDP(ar->sfl, index));
+
+    /* all blocks in the singular lists from this one on are big enough */
+    if (!IS_RANGED(index)) {
+      return new_block_ptr;
+    }
+
+    if (IS_TREE(index)) {
+      new_block_ptr = tree_find(new_block_ptr, size);
+    } else {
+      while (new_block_ptr && GET_SIZE(HDRP(new_block_ptr)) < size) {
+        new_block_ptr = NEXT_FREE_BLKP(new_block_ptr);
+      }
+    }
+
+    /* if none of the blocks in the tree are sufficient size, continue */
+    if (new_block_ptr) {
+      return new_block_ptr;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * split - Split given block if needed; returns pointer to the free block of
+ * desired size. It does the splitting abnormally so that the first block is the
+ * one to remain free and the second is the one to which the pointer is
+ * returned.
+ */
+static inline void *split(void *ptr, size_t size) {
+
+  size_t ptr_size = GET_SIZE(HDRP(ptr));
+  size_t diff = ptr_size - size;
+
+  if (diff < MIN_BLOCK_SIZE) { // minimal size requirement
+    return ptr;
+  } else if (size == 0) {
+    return ptr;
+  }
+
+  size_t pfree = GET_PFREE(HDRP(ptr));
+
+  // free block
+  PUT(HDRP(ptr), PACK(diff, 0, pfree));
+  PUT(FTRP(ptr), PACK(diff, 0, pfree));
+
+  // soon to be allocated block
+  void *next_blkp = NEXT_BLKP(ptr);
+  PUT(HDRP(next_blkp), PACK(size, 0, 2));
+  PUT(FTRP(next_blkp), PACK(size, 0, 2));
+
+  return next_blkp;
+}
+
+/*
+ * coalesce_front - Possibly coalesce the block in the front
+ */
+static void *coalesce_front(arena_t *ar, void *ptr) {
+
+  size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(ptr)));
+  size_t size = GET_SIZE(HDRP(ptr));
+
+  if (!next_alloc) { // next block is free
+
+    void *next_blkp = NEXT_BLKP(ptr);
+    size_t next_size = GET_SIZE(HDRP(next_blkp));
+
+    unlink_free(ar, next_blkp);
+
+    size += next_size;
+
+    size_t pfree = GET_PFREE(HDRP(ptr));
+
+    PUT(HDRP(ptr), PACK(size, 0, pfree));
+    PUT(FTRP(next_blkp), PACK(size, 0, pfree));
+  }
+
+  return ptr;
+}
+
+/*
+ * coalesce_back - Possibly coalesce the block in the back.
+ */
+static void *coalesce_back(arena_t *ar, void *ptr) {
+
+  size_t prev_alloc = !GET_PFREE(HDRP(ptr));
+  size_t size = GET_SIZE(HDRP(ptr));
+
+  if (!prev_alloc) {
+
+    void *prev_blkp = PREV_BLKP(ptr);
+    size_t prev_size = GET_SIZE(HDRP(prev_blkp));
+
+    remove_from_sfl(ar, prev_blkp, -1);
+
+    size += prev_size;
+
+    size_t pfree = GET_PFREE(HDRP(prev_blkp));
+
+    PUT(HDRP(prev_blkp), PACK(size, 0, pfree));
+    PUT(FTRP(ptr), PACK(size, 0, pfree));
+
+    return prev_blkp;
+  }
+
+  return ptr;
+}
+
+/*
+ * lock - Take the lock, yield the processor while it is taken by other thread
+ */
+static inline void lock(int *l) {
+
+  if (SINGLE_THREADED) {
+    return;
+  }
+
+  while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(l, __ATOMIC_RELAXED)) {
+      sched_yield();
+    }
+  }
+}
+
+/*
+ * unlock - Release the lock
+ */
+static inline void unlock(int *l) {
+  __atomic_store_n(l, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * arena_init - Initialize an arena without any regions
+ */
+static void arena_init(arena_t *ar, int id) {
+
+  for (int i = 0; i < SFL_SIZE; ++i) {
+    PUTP(ADD_VOIDP(ar->sfl, i), NULL);
+  }
+
+  for (int i = 0; i < RUN_CLASSES; ++i) {
+    ar->runs[i] = NULL;
+  }
+
+  for (int i = 0; i < SINGULAR_BLOCKS_NUM; ++i) {
+    ar->quick[i] = NULL;
+  }
+
+  ar->sfl_bitmap = 0;
+  ar->epilogue_blkp = NULL;
+  ar->last_region = NULL;
+  ar->heap_size = 0;
+  ar->grow_size = 0;
+  ar->requests = 0;
+  ar->grow_requests = 0;
+  ar->fresh = NULL;
+  ar->fresh_blkp = NULL;
+  ar->remote_frees = NULL;
+  ar->lock = 0;
+  ar->attached = 0;
+  ar->id = id;
+}
+
+static void tcache_flush(int index, int count);
+static void remote_drain(arena_t *ar);
+static void arena_free(arena_t *ar, void *ptr);
+static void arena_coalesce(arena_t *ar, void *ptr);
+static void arena_trim(arena_t *ar, void *ptr);
+static void run_free(arena_t *ar, void *ptr);
+
+/*
+ * arena_detach - Called when a thread exits, so its arena can be reused.
+ * Blocks cached by the thread and remote frees of the arena are freed. Remote
+ * frees which come later are freed when the arena is reused.
+ */
+static void arena_detach(void *ptr) {
+
+  arena_t *ar = ptr;
+
+  for (int i = 0; i < SINGULAR_BLOCKS_NUM; ++i) {
+    tcache_flush(i, tcache.counts[i]);
+  }
+
+  lock(&arenas_lock);
+  ar->attached--;
+  unlock(&arenas_lock);
+
+  lock(&ar->lock);
+  remote_drain(ar);
+  unlock(&ar->lock);
+}
+
+/*
+ * arena_key_init - Create key which destructor detaches arena of a thread
+ */
+static void arena_key_init(void) {
+  pthread_key_create(&arena_key, arena_detach);
+}
+
+/*
+ * arena_attach - Attach the thread to an arena. Arena left by an exited thread
+ * is reused first, then a new one is created if there are less than MAX_ARENAS
+ * of them. Otherwise an arena is shared, preferably the one which is not
+ * locked at the moment.
+ */
+static arena_t *arena_attach(void) {
+
+  arena_t *ar = NULL;
+
+  lock(&arenas_lock);
+
+  for (int i = 0; i < arena_count && !ar; ++i) {
+    if (!arenas[i].attached) {
+      ar = &arenas[i];
+    }
+  }
+
+  if (!ar && arena_count < MAX_ARENAS) {
+    ar = &arenas[arena_count];
+    arena_init(ar, arena_count);
+    arena_count++;
+  }
+
+  for (int i = 0; i < arena_count && !ar; ++i) {
+    if (!__atomic_load_n(&arenas[i].lock, __ATOMIC_RELAXED)) {
+      ar = &arenas[i];
+    }
+  }
+
+  if (!ar) {
+    ar = &arenas[next_shared++ % arena_count];
+  }
+
+  ar->attached++;
+
+  unlock(&arenas_lock);
+
+  thread_arena = ar;
+  pthread_setspecific(arena_key, ar);
+
+  return ar;
+}
+
+/*
+ * arena_get - Return arena of the thread, attaching it on first use
+ */
+static inline arena_t *arena_get(void) {
+
+  arena_t *ar = thread_arena;
+
+  if (!ar) {
+    ar = arena_attach();
+  }
+
+  return ar;
+}
+
+/*
+ * arena_of - Return the arena owning given block
+ */
+static inline arena_t *arena_of(void *ptr) {
+  return &arenas[page_map[PAGE_INDEX(ptr)] & ~RUN_FLAG];
+}
+
+/*
+ * is_remote - Check if a block of the arena should be freed through its remote
+ * frees. Arena without threads is not draining them, so it is locked instead.
+ */
+static inline bool is_remote(arena_t *ar) {
+  return !SINGLE_THREADED && ar != thread_arena &&
+         __atomic_load_n(&ar->attached, __ATOMIC_RELAXED);
+}
+
+/*
+ * remote_push - Push a block freed by a thread of other arena onto the list of
+ * remote frees of the owning arena. The link is stored in the payload.
+ */
+static inline void remote_push(arena_t *ar, void *ptr) {
+
+  void *head = __atomic_load_n(&ar->remote_frees, __ATOMIC_RELAXED);
+
+  do {
+    PUTP(ptr, head);
+  } while (!__atomic_compare_exchange_n(&ar->remote_frees, &head, ptr, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * remote_drain - Take all blocks from the list of remote frees of the locked
+ * arena and free them
+ */
+static void remote_drain(arena_t *ar) {
+
+  void *ptr = __atomic_exchange_n(&ar->remote_frees, NULL, __ATOMIC_ACQUIRE);
+
+  while (ptr) {
+    void *next = GETP(ptr);
+
+    if (IS_RUN(ptr)) {
+      run_free(ar, ptr);
+    } else {
+      arena_free(ar, ptr);
+    }
+    ptr = next;
+  }
+}
+
+/*
+ * heap_grow_size - Size the heap of the arena grows by at least. It doubles while
+ * the heap keeps growing by GROW_RATE bytes per request since it grew last,
+ * and halves for every halving of this rate below it, between chunk_size and
+ * chunk_max, but below trim_threshold so the growth is not given back at once.
+ */
+static size_t heap_grow_size(arena_t *ar) {
+
+  unsigned long requests = ar->requests - ar->grow_requests;
+  size_t grow = ar->grow_size;
+
+  ar->grow_requests = ar->requests;
+
+  if (grow == 0) {
+    grow = chunk_size;
+  } else if (requests * GROW_RATE <= grow) {
+    if (2 * grow <= chunk_max && 2 * grow < trim_threshold) {
+      grow *= 2;
+    }
+  } else {
+    for (size_t slow = requests * GROW_RATE / grow; slow > 1; slow >>= 1) {
+      grow /= 2;
+    }
+  }
+
+  ar->grow_size = grow < chunk_size ? chunk_size : grow;
+
+  return ar->grow_size;
+}
+
+/*
+ * fresh_advance - Move the start of the zeroed part of the wilderness of the
+ * arena up to ptr, as the memory below it has been handed out
+ */
+static inline void fresh_advance(arena_t *ar, char *ptr) {
+
+  if (ptr > ar->fresh) {
+    ar->fresh = ptr;
+  }
+}
+
+/*
+ * extend_heap - Make the wilderness of the arena at least of given size by
+ * increasing the heap and return it. The heap grows by a multiple of
+ * chunk_size, and at least by the size given by heap_grow_size. If the arena
+ * is at the top of the heap, its last region is extended. Otherwise a new
+ * region is started at the next page boundary, so every page belongs to one
+ * arena, and the old wilderness is added to segregated free lists.
+ * Memory which memlib hands out zeroed becomes the zeroed part of the
+ * wilderness.
+ */
+static void *extend_heap(arena_t *ar, size_t size) {
+
+  lock(&heap_lock);
+
+  char *brk = (char *)mem_heap_hi() + 1;
+  char *fresh = mem_fresh();
+  char *free_blkp;
+  size_t grow = heap_grow_size(ar);
+
+  /* a free block at the end of the arena is extended */
+  void *last_blkp = WILDERNESS(ar);
+  size_t last_size = last_blkp ? GET_SIZE(HDRP(last_blkp)) : 0;
+  size_t mem_incr = ROUND_MEM(size - last_size);
+
+  /* the growth is cut to the room left in the segment of the heap top */
+  if (mem_incr < grow && grow <= mem_room()) {
+    mem_incr = grow;
+  }
+
+  if (ar->epilogue_blkp + WSIZE == brk && mem_incr <= mem_room()) {
+
+    if (mem_sbrk(mem_incr) == (void *)-1) {
+      unlock(&heap_lock);
+      return NULL;
+    }
+
+    fresh = fresh > brk ? fresh : brk;
+
+    /* the old footer and epilogue header join the zeroed part in between */
+    if (last_size && ar->fresh < brk && fresh == brk) {
+      PUT(brk - DSIZE, 0);
+      PUT(brk - WSIZE, 0);
+    } else {
+      ar->fresh = fresh;
+    }
+
+    if (last_size) {
+      free_blkp = brk - last_size;
+      PUT(HDRP(free_blkp),
+          PACK(last_size + mem_incr, 0, GET_PFREE(HDRP(free_blkp))));
+    } else {
+      free_blkp = brk;
+      PUT(HDRP(free_blkp), PACK(mem_incr, 0, GET_PFREE(ar->epilogue_blkp)));
+    }
+
+  } else {
+
+    size_t padding = (brk - heap_lo) & (PAGE_SIZE - 1);
+    padding = padding ? PAGE_SIZE - padding : 0;
+    mem_incr = ROUND_MEM(size + REGION_OVERHEAD);
+    mem_incr = mem_incr < grow ? grow : mem_incr;
+
+    /* a new segment of the heap starts at a page boundary */
+    if (padding + mem_incr > mem_room()) {
+      padding = 0;
+    }
+
+    char *region = mem_sbrk(padding + mem_incr);
+
+    if (region == (void *)-1) {
+      unlock(&heap_lock);
+      return NULL;
+    }
+
+    if (WILDERNESS(ar)) {
+      add_to_sfl(ar, WILDERNESS(ar));
+    }
+
+    region += padding;
+
+    PUTP(region, ar->last_region); // link to the previous region
+    PUT(region + PSIZE, 0);        // alignment padding
+    ar->last_region = region;
+
+    free_blkp = region + REGION_OVERHEAD;
+    mem_incr -= REGION_OVERHEAD;
+    PUT(HDRP(free_blkp), PACK(mem_incr, 0, 0));
+
+    /* a new segment is zeroed from its start */
+    if (region - padding != brk || fresh < free_blkp) {
+      fresh = free_blkp;
+    }
+    ar->fresh = fresh;
+  }
+
+  /* Move epilogue header */
+  PUT(FTRP(free_blkp), GET(HDRP(free_blkp)));
+  ar->epilogue_blkp = HDRP(free_blkp) + GET_SIZE(HDRP(free_blkp));
+  ar->heap_size += mem_incr;
+  PUT(ar->epilogue_blkp, PACK(0, 1, 2)); // new epilogue header
+
+  memset(&page_map[PAGE_INDEX(free_blkp)], ar->id,
+         PAGE_INDEX(ar->epilogue_blkp) - PAGE_INDEX(free_blkp) + 1);
+  page_map_used = PAGE_INDEX(ar->epilogue_blkp) + 1;
+
+  unlock(&heap_lock);
+
+  return free_blkp;
+}
+
+/*
+ * mm_init - Called when a new trace starts.
+ */
+int mm_init(void) {
+
+  pthread_once(&arena_key_once, arena_key_init);
+  pthread_once(&class_table_once, class_table_init);
+
+  char *region = mem_sbrk(REGION_OVERHEAD);
+
+  /* REGION_OVERHEAD for the first region of the main arena:
+   * PSIZE for link to the previous region
+   * WSIZE for alignment padding
+   * WSIZE for epilogue header
+   */
+
+  if (region == (void *)-1) {
+    return -1;
+  }
+
+  heap_lo = mem_heap_lo();
+
+  /* pages owned by other arenas or holding runs */
+  memset(page_map, 0, page_map_used);
+  page_map_used = 0;
+
+  arena_t *ar = &arenas[0];
+
+  arena_init(ar, 0);
+  arena_count = 1;
+  next_shared = 0;
+
+  PUTP(region, NULL);     // there is no previous region
+  PUT(region + PSIZE, 0); // alignment padding
+  ar->last_region = region;
+  ar->epilogue_blkp = region + REGION_OVERHEAD - WSIZE;
+  PUT(ar->epilogue_blkp, PACK(0, 1, 0)); // epilogue header
+
+  /* the thread which initializes the allocator uses the main arena */
+  memset(&tcache, 0, sizeof(tcache));
+  ar->attached = 1;
+  thread_arena = ar;
+  pthread_setspecific(arena_key, ar);
+
+  return 0;
+}
+
+/*
+ * fork_prepare - Take all locks before the process forks, so the child gets
+ * the heap in a consistent state
+ */
+static void fork_prepare(void) {
+
+  lock(&arenas_lock);
+  for (int i = 0; i < arena_count; ++i) {
+    lock(&arenas[i].lock);
+  }
+  lock(&heap_lock);
+}
+
+/*
+ * fork_parent - Release the locks taken by fork_prepare in the parent
+ */
+static void fork_parent(void) {
+
+  unlock(&heap_lock);
+  for (int i = arena_count - 1; i >= 0; --i) {
+    unlock(&arenas[i].lock);
+  }
+  unlock(&arenas_lock);
+}
+
+/*
+ * fork_child - Release the locks taken by fork_prepare in the child, where
+ * only the forking thread is left attached to its arena
+ */
+static void fork_child(void) {
+
+  for (int i = 0; i < arena_count; ++i) {
+    arenas[i].attached = &arenas[i] == thread_arena;
+  }
+  fork_parent();
+}
+
+/*
+ * lazy_init - Initialize the allocator on the first call when it is the malloc
+ * of a process. The heap is reserved up front, unlike the simulated one.
+ */
+static void lazy_init(void) {
+
+  mem_set_backend(MEM_RESERVED);
+  mem_init();
+  if (mm_init() == 0) {
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+  }
+}
+
+/*
+ * ensure_init - Initialize the allocator if it is not yet. Returns false if
+ * the initialization failed.
+ */
+static inline bool ensure_init(void) {
+
+  if (LAZY_INIT && !heap_lo) {
+    pthread_once(&lazy_init_once, lazy_init);
+    return heap_lo != NULL;
+  }
+
+  return true;
+}
+
+/*
+ * tcache_release - Free all blocks of the thread cache which belong to the
+ * locked arena. Returns the number of freed blocks.
+ */
+static int tcache_release(arena_t *ar) {
+
+  int released = 0;
+
+  for (int i = 0; i < SINGULAR_BLOCKS_NUM; ++i) {
+
+    void **prev = &tcache.bins[i];
+    void *ptr;
+
+    while ((ptr = *prev)) {
+      if (arena_of(ptr) != ar) {
+        prev = ptr;
+        continue;
+      }
+
+      *prev = GETP(ptr);
+      tcache.counts[i]--;
+      arena_free(ar, ptr);
+      released++;
+    }
+  }
+
+  return released;
+}
+
+/*
+ * quick_release - Coalesce all blocks on the quick lists of the arena and add
+ * them to segregated free lists. Returns the number of released blocks.
+ */
+static int quick_release(arena_t *ar) {
+
+  int released = 0;
+
+  for (int i = 0; i < SINGULAR_BLOCKS_NUM; ++i) {
+
+    void *ptr;
+
+    while ((ptr = ar->quick[i])) {
+      ar->quick[i] = GETP(ptr);
+      arena_coalesce(ar, ptr);
+      released++;
+    }
+  }
+
+  return released;
+}
+
+/*
+ * arena_malloc - Allocate a block of given size, which is a multiple of
+ * ALIGNMENT, from the arena
+ */
+static void *arena_malloc(arena_t *ar, size_t size) {
+
+  ar->requests++;
+
+  /* block of the same size freed lately */
+  if (DEFER_COALESCING && !IS_RANGED(find_index(size))) {
+
+    void **quick = &ar->quick[find_index(size)];
+    void *ptr = *quick;
+
+    if (ptr) {
+      *quick = GETP(ptr);
+      return ptr;
+    }
+  }
+
+  void *free_blkp = find_block(ar, size);
+
+  /* free block in the sfl is found */
+  if (free_blkp) {
+
+    size_t old_size = GET_SIZE(HDRP(free_blkp));
+    int old_size_index = find_index(old_size);
+
+    /* the block stays in sfl if splitting leaves it in the same size class and
+     * in the same place of the tree */
+    bool stays = old_size != size &&
+                 find_index(old_size - size) == old_size_index &&
+                 tree_in_order(free_blkp, old_size - size);
+
+    /* remove the block from sfl before splitting since footer of the small
+     * split block may overwrite its tree fields */
+    if (!stays) {
+      remove_from_sfl(ar, free_blkp, old_size_index);
+    }
+
+    void *split_blkp = split(free_blkp, size);
+
+    /* add split block back to sfl */
+    if (!stays && split_blkp != free_blkp) {
+      add_to_sfl(ar, free_blkp);
+    } else if (stays) {
+      tree_update_path(free_blkp);
+    }
+
+    /* marking the block as allocated */
+    PUT(HDRP(split_blkp), PACK(GET_SIZE(HDRP(split_blkp)), 1,
+                               GET_PFREE(HDRP(split_blkp))));
+
+    PUT_PFREE(HDRP(NEXT_BLKP(split_blkp)), 0);
+    return split_blkp;
+  }
+
+  /* Suitable block was not found in the segregated free lists so it is carved
+   * from the wilderness */
+  free_blkp = WILDERNESS(ar);
+
+  if (!free_blkp || GET_SIZE(HDRP(free_blkp)) < size) {
+
+    /* Before increasing the heap try again with the blocks of the arena which
+     * are kept in the thread cache or wait for coalescing */
+    if (tcache_release(ar) || quick_release(ar)) {
+      return arena_malloc(ar, size);
+    }
+
+    free_blkp = extend_heap(ar, size);
+
+    if (!free_blkp) {
+      return NULL;
+    }
+  }
+
+  size_t pfree = GET_PFREE(HDRP(free_blkp));
+  size_t rest_size = GET_SIZE(HDRP(free_blkp)) - size;
+
+  if (rest_size < MIN_BLOCK_SIZE) {
+    size += rest_size;
+    rest_size = 0;
+  }
+
+  /* a block from the zeroed part reads as zeros, but for its last word, which
+   * may be the footer of the wilderness */
+  ar->fresh_blkp = (char *)free_blkp >= ar->fresh ? free_blkp : NULL;
+  fresh_advance(ar, (char *)free_blkp + size);
+
+  PUT(HDRP(free_blkp), PACK(size, 1, pfree));
+
+  /* The remaining part stays the wilderness */
+  if (rest_size) {
+    void *rest_blkp = NEXT_BLKP(free_blkp);
+
+    PUT(HDRP(rest_blkp), PACK(rest_size, 0, 0));
+    PUT(FTRP(rest_blkp), PACK(rest_size, 0, 0));
+  } else {
+    PUT_PFREE(ar->epilogue_blkp, 0);
+  }
+
+  return free_blkp;
+}
+
+/*
+ * aligned_lead - Size of the slack in front of the free block ptr up to the
+ * first address which is a multiple of align and leaves a slack big enough to
+ * be a free block, or none
+ */
+static inline size_t aligned_lead(void *ptr, size_t align) {
+
+  size_t lead = -(uintptr_t)ptr & (align - 1);
+
+  if (lead && lead < MIN_BLOCK_SIZE) {
+    lead += align;
+  }
+
+  return lead;
+}
+
+/*
+ * tree_lower - Return the first node of the tree which block is at least of
+ * given size; the first such node in address order in address ordered trees
+ */
+static inline void *tree_lower(void *node, size_t size) {
+
+  if (RANGED_POLICY == RANGED_ADDRESS) {
+    return tree_find(node, size);
+  }
+
+  void *best = NULL;
+
+  while (node) {
+    if (GET_SIZE(HDRP(node)) >= size) {
+      best = node;
+      node = LEFT_BLKP(node);
+    } else {
+      node = RIGHT_BLKP(node);
+    }
+  }
+
+  return best;
+}
+
+/*
+ * find_aligned - Find a free block which holds a block of given size at an
+ * address which is a multiple of align. At most ALIGNED_SCAN blocks of every
+ * list are tried, starting from the smallest ones in trees.
+ */
+static void *find_aligned(arena_t *ar, size_t size, size_t align) {
+
+  uint64_t lists = ar->sfl_bitmap & (~0ull << find_index(size));
+
+  for (; lists; lists &= lists - 1) {
+
+    int index = __builtin_ctzll(lists);
+    void *node = GETP(ADD_VOIDP(ar->sfl, index));
+    int scan = ALIGNED_SCAN;
+
+    if (IS_TREE(index)) {
+      node = tree_lower(node, size);
+    }
+
+    /* nodes of trees ordered by size head lists of blocks of their size */
+    for (; node && scan > 0; node = IS_TREE(index) ? tree_next(node) : NULL) {
+      for (void *ptr = node; ptr && scan > 0; ptr = NEXT_FREE_BLKP(ptr)) {
+        if (aligned_lead(ptr, align) + size <= GET_SIZE(HDRP(ptr))) {
+          return ptr;
+        }
+        scan--;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * arena_malloc_aligned - Allocate a block of given size, which is a multiple of
+ * ALIGNMENT, at an address which is a multiple of align from the arena.
+ * A free block which holds it is split in place, the slack in front of the
+ * block and behind it going back to the free lists. Otherwise a block big
+ * enough for any placement is allocated and the slack is freed.
+ */
+static void *arena_malloc_aligned(arena_t *ar, size_t size, size_t align) {
+
+  char *ptr = find_aligned(ar, size, align);
+
+  if (ptr) {
+    size_t block_size = GET_SIZE(HDRP(ptr));
+    size_t lead = aligned_lead(ptr, align);
+
+    ar->requests++;
+    remove_from_sfl(ar, ptr, -1);
+
+    if (lead) {
+      PUT(HDRP(ptr), PACK(lead, 0, GET_PFREE(HDRP(ptr))));
+      PUT(FTRP(ptr), PACK(lead, 0, GET_PFREE(HDRP(ptr))));
+      add_to_sfl(ar, ptr);
+
+      ptr += lead;
+      block_size -= lead;
+    }
+
+    size_t rest_size = block_size - size;
+
+    if (rest_size < MIN_BLOCK_SIZE) {
+      PUT(HDRP(ptr), PACK(block_size, 1, lead ? 2 : GET_PFREE(HDRP(ptr))));
+      PUT_PFREE(HDRP(NEXT_BLKP(ptr)), 0);
+      return ptr;
+    }
+
+    PUT(HDRP(ptr), PACK(size, 1, lead ? 2 : GET_PFREE(HDRP(ptr))));
+    PUT(HDRP(ptr + size), PACK(rest_size, 0, 0));
+    PUT(FTRP(ptr + size), PACK(rest_size, 0, 0));
+    add_to_sfl(ar, ptr + size);
+
+    return ptr;
+  }
+
+  ptr = arena_malloc(ar, size + align + MIN_BLOCK_SIZE);
+
+  if (!ptr) {
+    return NULL;
+  }
+
+  size_t block_size = GET_SIZE(HDRP(ptr));
+  size_t lead = aligned_lead(ptr, align);
+
+  if (lead) {
+    PUT(HDRP(ptr + lead), PACK(block_size - lead, 1, 0));
+    PUT(HDRP(ptr), PACK(lead, 1, GET_PFREE(HDRP(ptr))));
+    arena_free(ar, ptr);
+
+    ptr += lead;
+    block_size -= lead;
+  }
+
+  if (block_size - size >= MIN_BLOCK_SIZE) {
+    PUT(HDRP(ptr), PACK(size, 1, GET_PFREE(HDRP(ptr))));
+    PUT(HDRP(ptr + size), PACK(block_size - size, 1, 0));
+    arena_free(ar, ptr + size);
+  }
+
+  return ptr;
+}
+
+/*
+ * arena_malloc_batch - Allocate n blocks of given size, which is a multiple of
+ * ALIGNMENT, from the arena. They are carved one after another from a single
+ * free block big enough for all of them, or from the wilderness, else they are
+ * allocated one by one. Returns the number of allocated blocks.
+ */
+static int arena_malloc_batch(arena_t *ar, size_t size, int n, void **ptrs) {
+
+  size_t total;
+  char *free_blkp = NULL;
+
+  if (!__builtin_mul_overflow(size, (size_t)n, &total) && total < MAX_HEAP) {
+    free_blkp = find_block(ar, total);
+  }
+
+  if (free_blkp) {
+    remove_from_sfl(ar, free_blkp, -1);
+  } else if (total < MAX_HEAP) {
+    free_blkp = WILDERNESS(ar);
+
+    if (free_blkp && GET_SIZE(HDRP(free_blkp)) < total) {
+      free_blkp = NULL;
+    }
+  }
+
+  /* otherwise the blocks are allocated one by one, so smaller free blocks are
+   * used before the heap grows */
+  if (!free_blkp) {
+    int i = 0;
+
+    while (i < n && (ptrs[i] = arena_malloc(ar, size))) {
+      i++;
+    }
+    return i;
+  }
+
+  ar->requests += n;
+
+  bool wilderness = IS_WILDERNESS(ar, free_blkp);
+  size_t rest_size = GET_SIZE(HDRP(free_blkp)) - total;
+  size_t pfree = GET_PFREE(HDRP(free_blkp));
+  char *ptr = free_blkp;
+
+  for (int i = 0; i < n; ++i) {
+    PUT(HDRP(ptr), PACK(size, 1, pfree));
+    ptrs[i] = ptr;
+    ptr += size;
+    pfree = 0;
+  }
+
+  if (wilderness) {
+    fresh_advance(ar, ptr + (rest_size < MIN_BLOCK_SIZE ? rest_size : 0));
+  }
+
+  /* the rest goes back to the free lists or stays the wilderness */
+  if (rest_size < MIN_BLOCK_SIZE) {
+    ptr = ptrs[n - 1];
+    PUT(HDRP(ptr), PACK(size + rest_size, 1, GET_PFREE(HDRP(ptr))));
+    PUT_PFREE(HDRP(NEXT_BLKP(ptr)), 0);
+  } else {
+    PUT(HDRP(ptr), PACK(rest_size, 0, 0));
+    PUT(FTRP(ptr), PACK(rest_size, 0, 0));
+
+    if (!wilderness) {
+      add_to_sfl(ar, ptr);
+    }
+  }
+
+  return n;
+}
+
+/*
+ * run_create - Allocate a page aligned run of slots of given size and make it
+ * the first run of its size class in the arena
+ */
+static run_t *run_create(arena_t *ar, int class) {
+
+  run_t *run = arena_malloc_aligned(ar, RUN_BLOCK_SIZE, PAGE_SIZE);
+
+  if (!run) {
+    return NULL;
+  }
+
+  int slot_size = (class + 1) * ALIGNMENT;
+  int slots = (PAGE_SIZE - RUN_HEADER) / slot_size;
+
+  memset(run->bitmap, 0, sizeof(run->bitmap));
+  for (int i = 0; i < slots; i += 64) {
+    run->bitmap[i / 64] = slots - i < 64 ? (1ULL << (slots - i)) - 1 : ~0ULL;
+  }
+
+  run->slot_size = slot_size;
+  run->free_slots = slots;
+  run->prev = NULL;
+  run->next = NULL;
+  ar->runs[class] = run;
+
+  page_map[PAGE_INDEX(run)] = ar->id | RUN_FLAG;
+
+  return run;
+}
+
+/*
+ * run_malloc - Allocate a slot for a request of at most RUN_MAX bytes from the
+ * first run of its size class in the arena. Run without free slots is removed
+ * from the list of its class.
+ */
+static void *run_malloc(arena_t *ar, size_t size) {
+
+  int class = size <= ALIGNMENT ? 0 : (size - 1) / ALIGNMENT;
+  run_t *run = ar->runs[class];
+
+  if (!run && !(run = run_create(ar, class))) {
+    return NULL;
+  }
+
+  int word = 0;
+
+  while (!run->bitmap[word]) {
+    word++;
+  }
+
+  int slot = word * 64 + __builtin_ctzll(run->bitmap[word]);
+
+  run->bitmap[word] &= run->bitmap[word] - 1;
+
+  if (!--run->free_slots) {
+    ar->runs[class] = run->next;
+    if (run->next) {
+      run->next->prev = NULL;
+    }
+  }
+
+  return (char *)run + RUN_HEADER + slot * run->slot_size;
+}
+
+/*
+ * run_free - Free a slot of a run of the arena. Run which gets a free slot is
+ * added to the list of its class and run without used slots is freed, unless
+ * it is the only run of its class with free slots.
+ */
+static void run_free(arena_t *ar, void *ptr) {
+
+  run_t *run = RUN_OF(ptr);
+  int class = run->slot_size / ALIGNMENT - 1;
+  int slot = ((char *)ptr - (char *)run - RUN_HEADER) / run->slot_size;
+
+  run->bitmap[slot / 64] |= 1ULL << (slot % 64);
+
+  if (!run->free_slots++) {
+    run->prev = NULL;
+    run->next = ar->runs[class];
+    if (run->next) {
+      run->next->prev = run;
+    }
+    ar->runs[class] = run;
+  }
+
+  if (run->free_slots < (PAGE_SIZE - RUN_HEADER) / run->slot_size ||
+      (!run->prev && !run->next)) {
+    return;
+  }
+
+  if (run->prev) {
+    run->prev->next = run->next;
+  } else {
+    ar->runs[class] = run->next;
+  }
+  if (run->next) {
+    run->next->prev = run->prev;
+  }
+
+  page_map[PAGE_INDEX(run)] = ar->id;
+  arena_free(ar, run);
+}
+
+/*
+ * mapped_malloc - Allocate a block of given size in a new mapped region
+ */
+static void *mapped_malloc(size_t size) {
+
+  if (size > SIZE_MAX - MAPPED_OVERHEAD - PAGE_SIZE) {
+    return NULL;
+  }
+
+  size_t region_size = ROUND_PAGE(size + MAPPED_OVERHEAD);
+
+  lock(&heap_lock);
+  char *region = mem_map(region_size);
+  unlock(&heap_lock);
+
+  if (region == (void *)-1) {
+    return NULL;
+  }
+
+  char *ptr = region + MAPPED_OVERHEAD;
+
+  MAPPED_SIZE(ptr) = region_size;
+  MAPPED_LEAD(ptr) = 0;
+  return ptr;
+}
+
+/*
+ * mapped_malloc_aligned - Allocate a block of given size at an address which
+ * is a multiple of align in a new mapped region. The region has room for any
+ * lead the alignment needs in front of the header.
+ */
+static void *mapped_malloc_aligned(size_t size, size_t align) {
+
+  if (size > SIZE_MAX - align - PAGE_SIZE) {
+    return NULL;
+  }
+
+  size_t region_size = ROUND_PAGE(size + align);
+
+  lock(&heap_lock);
+  char *region = mem_map(region_size);
+  unlock(&heap_lock);
+
+  if (region == (void *)-1) {
+    return NULL;
+  }
+
+  char *ptr = region + MAPPED_OVERHEAD;
+  size_t lead = -(uintptr_t)ptr & (align - 1);
+
+  ptr += lead;
+  MAPPED_SIZE(ptr) = region_size - lead;
+  MAPPED_LEAD(ptr) = lead;
+  return ptr;
+}
+
+/*
+ * mapped_free - Unmap the region of a mapped block
+ */
+static void mapped_free(void *ptr) {
+
+  lock(&heap_lock);
+  mem_unmap((char *)ptr - MAPPED_OVERHEAD - MAPPED_LEAD(ptr));
+  unlock(&heap_lock);
+}
+
+/*
+ * mapped_realloc - Change the size of the region of a mapped block, which may
+ * move it without copying
+ */
+static void *mapped_realloc(void *ptr, size_t size) {
+
+  size_t lead = MAPPED_LEAD(ptr);
+
+  if (size > SIZE_MAX - MAPPED_OVERHEAD - PAGE_SIZE - lead) {
+    return NULL;
+  }
+
+  size_t region_size = ROUND_PAGE(size + MAPPED_OVERHEAD + lead);
+
+  if (region_size == MAPPED_SIZE(ptr) + lead) {
+    return ptr;
+  }
+
+  lock(&heap_lock);
+  char *region = mem_remap((char *)ptr - MAPPED_OVERHEAD - lead, region_size);
+  unlock(&heap_lock);
+
+  if (region == (void *)-1) {
+    return NULL;
+  }
+
+  /* the lead moves with the region */
+  ptr = region + lead + MAPPED_OVERHEAD;
+  MAPPED_SIZE(ptr) = region_size - lead;
+  return ptr;
+}
+
+/*
+ * malloc - Allocate a block from the thread cache, by finding a free one in
+ * segregated free lists of the arena of the thread or by allocating a chunk of
+ * size CHUNK_SIZE and then splitting it if necessary.
+ * Always allocate a block which size is a multiple of ALIGNMENT
+ */
+void *malloc(size_t size) {
+
+  if (!ensure_init()) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (size >= mmap_threshold) {
+    return mapped_malloc(size);
+  }
+
+  size_t request = size;
+
+  size = BLOCK_SIZE(size);
+
+  int index = find_index(size);
+  void *ptr;
+
+  if (!IS_RANGED(index) && (ptr = tcache.bins[index])) {
+    tcache.bins[index] = GETP(ptr);
+    tcache.counts[index]--;
+    return ptr;
+  }
+
+  arena_t *ar = arena_get();
+
+  lock(&ar->lock);
+  if (__atomic_load_n(&ar->remote_frees, __ATOMIC_RELAXED)) {
+    remote_drain(ar);
+  }
+
+  if (request <= RUN_MAX && ar->heap_size >= RUN_MIN_HEAP) {
+    ptr = run_malloc(ar, request);
+  } else {
+    ptr = arena_malloc(ar, size);
+  }
+  unlock(&ar->lock);
+
+  return ptr;
+}
+
+/*
+ * arena_trim - Shrink the heap by the wilderness of the arena if it is big
+ * enough and the arena is at the top of the heap.
+ */
+static void arena_trim(arena_t *ar, void *ptr) {
+
+  size_t size = GET_SIZE(HDRP(ptr));
+
+  if (size < trim_threshold) {
+    return;
+  }
+
+  lock(&heap_lock);
+
+  if (ar->epilogue_blkp + WSIZE != (char *)mem_heap_hi() + 1) {
+    unlock(&heap_lock);
+    return;
+  }
+
+  /* the wilderness is left as it is if the heap cannot shrink by it */
+  if (mem_sbrk(-(long)size) == (void *)-1) {
+    unlock(&heap_lock);
+    return;
+  }
+
+  /* the block before is allocated after coalescing */
+  ar->epilogue_blkp = HDRP(ptr);
+  PUT(ar->epilogue_blkp, PACK(0, 1, 0));
+  ar->heap_size -= size;
+  ar->grow_size = 0;
+
+  unlock(&heap_lock);
+}
+
+/*
+ * arena_free - Free a block to the arena. Blocks of the singular sizes are put
+ * onto the quick lists when coalescing is deferred.
+ */
+static void arena_free(arena_t *ar, void *ptr) {
+
+  if (DEFER_COALESCING && !IS_RANGED(find_index(GET_SIZE(HDRP(ptr))))) {
+
+    void **quick = &ar->quick[find_index(GET_SIZE(HDRP(ptr)))];
+
+    PUTP(ptr, *quick);
+    *quick = ptr;
+    return;
+  }
+
+  arena_coalesce(ar, ptr);
+}
+
+/*
+ * arena_coalesce - Free a block, coalesce if possible and add it to segregated
+ * free list of the arena
+ */
+static void arena_coalesce(arena_t *ar, void *ptr) {
+
+  size_t size = GET_SIZE(HDRP(ptr));
+  size_t pfree = GET_PFREE(HDRP(ptr));
+
+  PUT(HDRP(ptr), PACK(size, 0, pfree));
+  PUT(FTRP(ptr), PACK(size, 0, pfree));
+
+  /* switching previous free bit in the next block */
+  PUT_PFREE(HDRP(NEXT_BLKP(ptr)), 2);
+
+  coalesce_front(ar, ptr);
+  ptr = coalesce_back(ar, ptr);
+
+  if (!IS_WILDERNESS(ar, ptr)) {
+    add_to_sfl(ar, ptr);
+  } else {
+    arena_trim(ar, ptr);
+  }
+}
+
+/*
+ * tcache_flush - Free given number of blocks from the bin of the thread cache.
+ * Blocks of other arenas are pushed onto their remote frees. Lock of the arena
+ * of the thread is kept as long as consecutive blocks belong to it.
+ */
+static void tcache_flush(int index, int count) {
+
+  arena_t *locked = NULL;
+
+  for (; count > 0; --count) {
+
+    void *ptr = tcache.bins[index];
+    arena_t *ar = arena_of(ptr);
+
+    tcache.bins[index] = GETP(ptr);
+    tcache.counts[index]--;
+
+    if (is_remote(ar)) {
+      remote_push(ar, ptr);
+      continue;
+    }
+
+    if (ar != locked) {
+      if (locked) {
+        unlock(&locked->lock);
+      }
+      lock(&ar->lock);
+      locked = ar;
+    }
+
+    arena_free(ar, ptr);
+  }
+
+  if (locked) {
+    unlock(&locked->lock);
+  }
+}
+
+/*
+ * heap_free - Free a block of the heap which is not a slot of a run
+ */
+static inline void heap_free(void *ptr) {
+
+  int index = find_index(GET_SIZE(HDRP(ptr)));
+
+  /* the cache only pays off when the arenas are locked and blocks followed by
+   * a free block are not cached so they coalesce; threads without an arena
+   * only free, and would not flush the cache when they exit */
+  if (!SINGLE_THREADED && thread_arena && !IS_RANGED(index) &&
+      GET_ALLOC(HDRP(NEXT_BLKP(ptr)))) {
+    if (tcache.counts[index] == TCACHE_COUNT) {
+      tcache_flush(index, TCACHE_COUNT / 2);
+    }
+
+    PUTP(ptr, tcache.bins[index]);
+    tcache.bins[index] = ptr;
+    tcache.counts[index]++;
+    return;
+  }
+
+  arena_t *ar = arena_of(ptr);
+
+  if (is_remote(ar)) {
+    remote_push(ar, ptr);
+    return;
+  }
+
+  lock(&ar->lock);
+  arena_free(ar, ptr);
+  unlock(&ar->lock);
+}
+
+/*
+ * free - In a multi-threaded process put a small block into the thread cache,
+ * flushing half of the bin if it is full. Other blocks are freed in the arena
+ * which owns them, or pushed onto its remote frees if it is not the arena of
+ * the thread.
+ */
+void free(void *ptr) {
+
+  if (ptr == NULL) {
+    return;
+  }
+
+  if (IS_MAPPED(ptr)) {
+    mapped_free(ptr);
+    return;
+  }
+
+  if (IS_RUN(ptr)) {
+
+    arena_t *ar = arena_of(ptr);
+
+    if (is_remote(ar)) {
+      remote_push(ar, ptr);
+      return;
+    }
+
+    lock(&ar->lock);
+    run_free(ar, ptr);
+    unlock(&ar->lock);
+    return;
+  }
+
+  heap_free(ptr);
+}
+
+/*
+ * mm_free_sized - Free a block given the size it was requested with, or any
+ * size up to its usable size. Blocks too big for runs are freed without
+ * looking up their page in the page map. Smaller blocks may be slots of runs
+ * or heap blocks, as arenas start runs only once they are big enough and
+ * realloc shrinks blocks in place, so they are freed as free does it.
+ */
+void mm_free_sized(void *ptr, size_t size) {
+
+  if (size <= RUN_MAX || IS_MAPPED(ptr)) {
+    free(ptr);
+    return;
+  }
+
+  heap_free(ptr);
+}
+
+/*
+ * resize_place - Mark the block of given size as allocated with the requested
+ * size. The rest behind it is freed if it is big enough to be a block.
+ */
+static void *resize_place(arena_t *ar, void *ptr, size_t size, size_t r_size) {
+
+  size_t rest_size = size - r_size;
+
+  if (rest_size < MIN_BLOCK_SIZE) {
+    r_size = size;
+    rest_size = 0;
+  }
+
+  PUT(HDRP(ptr), PACK(r_size, 1, GET(HDRP(ptr)) & 0x6));
+  void *next_blkp = NEXT_BLKP(ptr);
+
+  fresh_advance(ar, next_blkp);
+
+  if (rest_size) {
+    PUT(HDRP(next_blkp), PACK(rest_size, 0, 0));
+    PUT(FTRP(next_blkp), PACK(rest_size, 0, 0));
+
+    PUT_PFREE(HDRP(NEXT_BLKP(next_blkp)), 2);
+
+    coalesce_front(ar, next_blkp);
+
+    if (!IS_WILDERNESS(ar, next_blkp)) {
+      add_to_sfl(ar, next_blkp);
+    } else {
+      arena_trim(ar, next_blkp);
+    }
+  } else {
+    PUT_PFREE(HDRP(next_blkp), 0);
+    if (!GET_ALLOC(HDRP(next_blkp))) {
+      PUT(FTRP(next_blkp), GET(HDRP(next_blkp)));
+    }
+  }
+
+  return ptr;
+}
+
+/*
+ * grow_slack - Size of the free space left behind the block when realloc grows
+ * it to r_size bytes. Only blocks grown before get it.
+ */
+static inline size_t grow_slack(arena_t *ar, void *ptr, size_t r_size) {
+
+  if (!GET_GROWN(HDRP(ptr))) {
+    return 0;
+  }
+
+  size_t slack = r_size >> GROW_SLACK_SHIFT;
+  size_t limit = ar->heap_size >> GROW_SLACK_HEAP_SHIFT;
+
+  return ROUND(slack < limit ? slack : limit);
+}
+
+/*
+ * arena_resize - Try to change the size of the block in place by splitting it
+ * or by coalescing it with free blocks around it. A block ending the arena at
+ * the top of the heap is grown with the heap. Returns NULL if it is not
+ * possible.
+ */
+static void *arena_resize(arena_t *ar, void *old_ptr, size_t r_size) {
+
+  size_t old_size = GET_SIZE(HDRP(old_ptr));
+
+  /* If the requested size is smaller or equal than the currently allocated */
+  if (old_size >= r_size) {
+    return resize_place(ar, old_ptr, old_size, r_size);
   }
 
   void *next_blkp = NEXT_BLKP(old_ptr);
-  size_t next_blk_size = GET_SIZE(HDRP(next_blkp));
+  size_t next_size = GET_ALLOC(HDRP(next_blkp)) ? 0 : GET_SIZE(HDRP(next_blkp));
+  size_t prev_size =
+    GET_PFREE(HDRP(old_ptr)) ? GET_SIZE(HDRP(old_ptr) - WSIZE) : 0;
+
+  /* If the next block is free and sufficient size, coalesce current and next
+   * block. The rest of the next block stays free if it's too big.
+   */
+  if (next_size && old_size + next_size >= r_size) {
+    unlink_free(ar, next_blkp);
+    return resize_place(ar, old_ptr, old_size + next_size, r_size);
+  }
+
+  /* If the previous block is free, the payload is moved to its start and the
+   * blocks are coalesced, together with the next one if it is free too.
+   */
+  if (prev_size && prev_size + old_size + next_size >= r_size) {
+
+    void *prev_blkp = PREV_BLKP(old_ptr);
+
+    remove_from_sfl(ar, prev_blkp, -1);
+    if (next_size) {
+      unlink_free(ar, next_blkp);
+    }
+
+    memmove(prev_blkp, old_ptr, old_size - WSIZE);
+
+    return resize_place(ar, prev_blkp, prev_size + old_size + next_size,
+                        r_size);
+  }
+
+  /* If the block ends the arena at the top of the heap, possibly followed by
+   * a free block, the heap is extended behind it.
+   */
+  void *end_blkp = next_size ? NEXT_BLKP(next_blkp) : next_blkp;
+
+  if (HDRP(end_blkp) == ar->epilogue_blkp &&
+      ar->epilogue_blkp + WSIZE == (char *)mem_heap_hi() + 1) {
+
+    void *free_blkp = extend_heap(ar, r_size - old_size);
+
+    if (free_blkp == next_blkp) {
+      return resize_place(ar, old_ptr,
+                          old_size + GET_SIZE(HDRP(free_blkp)), r_size);
+    }
+
+    /* otherwise the heap was grown by other arena in the meantime and the
+     * wilderness is in a new region */
+  }
+
+  return NULL;
+}
+
+/*
+ * realloc - Change the size of the block in place if possible, else by calling
+ * malloc and copying the data.
+ */
+void *realloc(void *old_ptr, size_t size) {
+  /* If size == 0 then this is just free, and we return NULL. */
+  if (size == 0) {
+    free(old_ptr);
+    return NULL;
+  }
+
+  /* If old_ptr is NULL, then this is just malloc. */
+  if (!old_ptr)
+    return malloc(size);
+
+  /* No block nor mapped region holds sizes this close to SIZE_MAX, which would
+   * wrap around when the size of the block is computed */
+  if (size > SIZE_MAX - MAPPED_OVERHEAD - PAGE_SIZE) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  /* Mapped blocks are remapped as long as they are big enough to be mapped */
+  if (IS_MAPPED(old_ptr)) {
+
+    if (size >= mmap_threshold)
+      return mapped_realloc(old_ptr, size);
+
+    size_t old_size = MAPPED_SIZE(old_ptr) - MAPPED_OVERHEAD;
+    void *new_ptr = malloc(size);
+
+    if (!new_ptr)
+      return NULL;
+
+    memcpy(new_ptr, old_ptr, size < old_size ? size : old_size);
+    free(old_ptr);
+
+    return new_ptr;
+  }
+
+  /* Slots of runs are not resized, a new block is allocated unless the slot is
+   * big enough */
+  if (IS_RUN(old_ptr)) {
+
+    size_t slot_size = RUN_OF(old_ptr)->slot_size;
+
+    if (size <= slot_size)
+      return old_ptr;
+
+    void *new_ptr = malloc(size);
+
+    if (!new_ptr)
+      return NULL;
+
+    memcpy(new_ptr, old_ptr, slot_size);
+    free(old_ptr);
+
+    return new_ptr;
+  }
+
+  size_t old_size = GET_SIZE(HDRP(old_ptr));
+
+  /* Blocks which grow big enough to be mapped are moved to a mapped region,
+   * while blocks which shrink stay in place whatever their size */
+  if (size < mmap_threshold || BLOCK_SIZE(size) <= old_size) {
+
+    arena_t *ar = arena_of(old_ptr);
+
+    lock(&ar->lock);
+    void *ptr = arena_resize(ar, old_ptr, BLOCK_SIZE(size));
+
+    /* cached blocks of the arena may stand in the way */
+    if (!ptr && tcache_release(ar) + quick_release(ar)) {
+      ptr = arena_resize(ar, old_ptr, BLOCK_SIZE(size));
+    }
+
+    if (ptr && GET_SIZE(HDRP(ptr)) > old_size) {
+      SET_GROWN(HDRP(ptr));
+    }
+    unlock(&ar->lock);
+
+    if (ptr)
+      return ptr;
+  }
+
+  size_t slack = 0;
+
+  /* A block grown before is moved to a bigger block and the slack behind it is
+   * freed */
+  if (size < mmap_threshold) {
+    slack = grow_slack(arena_of(old_ptr), old_ptr, BLOCK_SIZE(size));
+    if (size + slack >= mmap_threshold) {
+      slack = 0;
+    }
+  }
+
+  void *new_ptr = malloc(size + slack);
+
+  /* If malloc() fails, the original block is left untouched. */
+  if (!new_ptr)
+    return NULL;
+
+  /* copy the payload, as much of it as the new block holds */
+  memcpy(new_ptr, old_ptr, size < old_size - WSIZE ? size : old_size - WSIZE);
+
+  /* Free the old block. */
+  free(old_ptr);
+
+  if (size < mmap_threshold && !IS_RUN(new_ptr)) {
+    arena_t *ar = arena_of(new_ptr);
+
+    lock(&ar->lock);
+    if (slack) {
+      resize_place(ar, new_ptr, GET_SIZE(HDRP(new_ptr)), BLOCK_SIZE(size));
+    }
+    SET_GROWN(HDRP(new_ptr));
+    unlock(&ar->lock);
+  }
+
+  return new_ptr;
+}
+
+/*
+ * zero - Set size bytes at ptr, which is aligned to ALIGNMENT, to zero. Big
+ * blocks are written with non-temporal stores, so they do not evict the cache.
+ */
+static void zero(void *ptr, size_t size) {
+
+#ifdef __SSE2__
+  if (size >= ZERO_STREAM_MIN) {
+    __m128i zeros = _mm_setzero_si128();
+    __m128i *p = ptr;
+    __m128i *end = (__m128i *)((char *)ptr + (size & -64));
+
+    for (; p < end; p += 4) {
+      _mm_stream_si128(p, zeros);
+      _mm_stream_si128(p + 1, zeros);
+      _mm_stream_si128(p + 2, zeros);
+      _mm_stream_si128(p + 3, zeros);
+    }
+    _mm_sfence();
+
+    memset(end, 0, size & 63);
+    return;
+  }
+#endif
+
+  memset(ptr, 0, size);
+}
+
+/*
+ * calloc - Allocate the block and set it to zero. Mapped blocks are zeroed by
+ * the system and blocks carved from the zeroed part of the wilderness are not
+ * written but for their last word.
+ */
+void *calloc(size_t nmemb, size_t size) {
+  size_t bytes;
+
+  if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (bytes >= mmap_threshold) {
+    return malloc(bytes);
+  }
+
+  if (bytes < CALLOC_FRESH_MIN) {
+    void *new_ptr = malloc(bytes);
+
+    /* If malloc() fails, skip zeroing out the memory. */
+    if (new_ptr)
+      memset(new_ptr, 0, bytes);
+
+    return new_ptr;
+  }
+
+  if (!ensure_init()) {
+    errno = ENOMEM;
+    return NULL;
+  }
 
-  /* If the next block is free and sufficient size, coalesce current and next
-   * block. It also splits the next block if it's too big.
-   */
-  if (!GET_ALLOC(HDRP(next_blkp)) && next_blk_size + old_size >= r_size) {
+  arena_t *ar = arena_get();
+
+  lock(&ar->lock);
+  if (__atomic_load_n(&ar->remote_frees, __ATOMIC_RELAXED)) {
+    remote_drain(ar);
+  }
 
-    remove_from_sfl(next_blkp, -1);
-    void *split_blkp = split(next_blkp, next_blk_size + old_size - r_size);
+  ar->fresh_blkp = NULL;
+  void *new_ptr = arena_malloc(ar, BLOCK_SIZE(bytes));
+  bool fresh = new_ptr && new_ptr == ar->fresh_blkp;
+  unlock(&ar->lock);
 
-    if (split_blkp != next_blkp) {
-      add_to_sfl(split_blkp);
-      PUT(HDRP(split_blkp), PACK(GET_SIZE(HDRP(split_blkp)), 0, 0));
-      PUT(FTRP(split_blkp), PACK(GET_SIZE(HDRP(split_blkp)), 0, 0));
-    } else {
-      next_blkp = NEXT_BLKP(next_blkp);
+  if (!new_ptr) {
+    errno = ENOMEM;
+  } else if (fresh) {
+    PUT(FTRP(new_ptr), 0);
+  } else {
+    zero(new_ptr, bytes);
+  }
+
+  return new_ptr;
+}
+
+/*
+ * memalign - Allocate a block at an address which is a multiple of align, a
+ * power of two. Blocks aligned stricter than ALIGNMENT are taken from the heap
+ * of the arena of the thread, or from a mapped region if they are big enough
+ * to be mapped.
+ */
+void *memalign(size_t align, size_t size) {
+
+  if (!align || (align & (align - 1))) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (align <= ALIGNMENT) {
+    return malloc(size);
+  }
+
+  if (!ensure_init() || size > MAX_HEAP || align > MAX_HEAP) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (size >= mmap_threshold) {
+    void *ptr = mapped_malloc_aligned(size, align);
+
+    if (!ptr) {
+      errno = ENOMEM;
+    }
+
+    return ptr;
+  }
+
+  arena_t *ar = arena_get();
+
+  lock(&ar->lock);
+  if (__atomic_load_n(&ar->remote_frees, __ATOMIC_RELAXED)) {
+    remote_drain(ar);
+  }
+
+  void *ptr = arena_malloc_aligned(ar, BLOCK_SIZE(size), align);
+  unlock(&ar->lock);
+
+  if (!ptr) {
+    errno = ENOMEM;
+  }
+
+  return ptr;
+}
+
+/*
+ * posix_memalign - Allocate an aligned block into memptr. The alignment must
+ * be a power of two and a multiple of the size of a pointer.
+ */
+int posix_memalign(void **memptr, size_t align, size_t size) {
+
+  if (align % sizeof(void *)) {
+    return EINVAL;
+  }
+
+  void *ptr = memalign(align, size);
+
+  if (!ptr) {
+    return errno;
+  }
+
+  *memptr = ptr;
+  return 0;
+}
+
+/*
+ * aligned_alloc - Allocate an aligned block, the same as memalign
+ */
+void *aligned_alloc(size_t align, size_t size) {
+  return memalign(align, size);
+}
+
+/*
+ * mm_usable_size - Return the number of bytes which can be written to the
+ * allocated block, which can be more than the requested size
+ */
+size_t mm_usable_size(void *ptr) {
+
+  if (ptr == NULL) {
+    return 0;
+  }
+
+  if (IS_MAPPED(ptr)) {
+    return MAPPED_SIZE(ptr) - MAPPED_OVERHEAD;
+  }
+
+  if (IS_RUN(ptr)) {
+    return RUN_OF(ptr)->slot_size;
+  }
+
+  return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+/*
+ * malloc_usable_size - Return the usable size of the block, as mm_usable_size
+ */
+size_t malloc_usable_size(void *ptr) {
+  return mm_usable_size(ptr);
+}
+
+/*
+ * mm_malloc_batch - Allocate n blocks of given size into ptrs, taking the lock
+ * of the arena once. Blocks of the heap are carved from one free block. Returns
+ * the number of allocated blocks, less than n if the memory ran out.
+ */
+int mm_malloc_batch(size_t size, int n, void **ptrs) {
+
+  if (n <= 0) {
+    return 0;
+  }
+
+  if (!ensure_init()) {
+    errno = ENOMEM;
+    return 0;
+  }
+
+  if (size >= mmap_threshold) {
+    int i = 0;
+
+    while (i < n && (ptrs[i] = malloc(size))) {
+      i++;
+    }
+    return i;
+  }
+
+  arena_t *ar = arena_get();
+  int i = 0;
+
+  lock(&ar->lock);
+  if (__atomic_load_n(&ar->remote_frees, __ATOMIC_RELAXED)) {
+    remote_drain(ar);
+  }
+
+  if (size <= RUN_MAX && ar->heap_size >= RUN_MIN_HEAP) {
+    while (i < n && (ptrs[i] = run_malloc(ar, size))) {
+      i++;
+    }
+  } else {
+    i = arena_malloc_batch(ar, BLOCK_SIZE(size), n, ptrs);
+  }
+  unlock(&ar->lock);
+
+  if (i < n) {
+    errno = ENOMEM;
+  }
+
+  return i;
+}
+
+/*
+ * ptr_compare - Order pointers by address, for qsort
+ */
+static int ptr_compare(const void *a, const void *b) {
+
+  uintptr_t x = (uintptr_t)*(void *const *)a;
+  uintptr_t y = (uintptr_t)*(void *const *)b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * mm_free_batch - Free n blocks, sorting ptrs by address in place. Blocks of
+ * the heap which follow each other are merged and freed as one block, so they
+ * are coalesced once. The lock of an arena is kept while consecutive blocks
+ * belong to it.
+ */
+void mm_free_batch(void **ptrs, int n) {
+
+  arena_t *locked = NULL;
+
+  qsort(ptrs, n, sizeof(void *), ptr_compare);
+
+  for (int i = 0; i < n; ++i) {
+
+    void *ptr = ptrs[i];
 
-      size_t next_alloc = GET_ALLOC(HDRP(next_blkp));
+    if (ptr == NULL) {
+      continue;
+    }
+
+    if (IS_MAPPED(ptr)) {
+      mapped_free(ptr);
+      continue;
+    }
+
+    arena_t *ar = arena_of(ptr);
+
+    if (is_remote(ar)) {
+      remote_push(ar, ptr);
+      continue;
+    }
 
-      PUT(HDRP(next_blkp), PACK(GET_SIZE(HDRP(next_blkp)), next_alloc, 0));
-      if (!next_alloc) {
-        PUT(FTRP(next_blkp), PACK(GET_SIZE(HDRP(next_blkp)), next_alloc, 0));
+    if (ar != locked) {
+      if (locked) {
+        unlock(&locked->lock);
       }
+      lock(&ar->lock);
+      locked = ar;
+    }
+
+    if (IS_RUN(ptr)) {
+      run_free(ar, ptr);
+      continue;
     }
 
-    coalesce_front(old_ptr);
+    size_t size = GET_SIZE(HDRP(ptr));
 
-    PUT(HDRP(old_ptr), PACK(r_size, 1, GET_PFREE(HDRP(old_ptr))));
+    while (i + 1 < n && ptrs[i + 1] == (char *)ptr + size) {
+      size += GET_SIZE(HDRP(ptrs[++i]));
+    }
 
-    return old_ptr;
+    PUT(HDRP(ptr), PACK(size, 1, GET_PFREE(HDRP(ptr))));
+    arena_free(ar, ptr);
   }
 
-  void *new_ptr = malloc(size);
+  if (locked) {
+    unlock(&locked->lock);
+  }
+}
 
-  /* If malloc() fails, the original block is left untouched. */
-  if (!new_ptr)
+/*
+ * mm_arena_create - Create a bump arena whose blocks are bump allocated from
+ * chunks of given size taken from the heap, the default size if it is 0.
+ * Returns NULL if the memory ran out or the size cannot be rounded.
+ */
+mm_bump_t *mm_arena_create(size_t chunk_size) {
+
+  if (chunk_size > SIZE_MAX - ALIGNMENT - BUMP_CHUNK_HEADER) {
+    errno = ENOMEM;
     return NULL;
+  }
 
-  /* copy the data */
-  memcpy(new_ptr, old_ptr, old_size);
+  mm_bump_t *bump = malloc(sizeof(mm_bump_t));
 
-  /* Free the old block. */
-  free(old_ptr);
+  if (!bump) {
+    return NULL;
+  }
 
-  return new_ptr;
+  bump->chunk_size = chunk_size ? ROUND(chunk_size) : BUMP_CHUNK_SIZE;
+  bump->chunks = NULL;
+  bump->ptr = NULL;
+  bump->end = NULL;
+
+  return bump;
 }
 
 /*
- * calloc - Allocate the block and set it to zero.
+ * bump_chunk - Take a chunk with room for size bytes from the heap and link
+ * it into the chunks of the bump arena, at the front if it becomes the
+ * current chunk, else behind the current one
  */
-void *calloc(size_t nmemb, size_t size) {
-  size_t bytes = nmemb * size;
-  void *new_ptr = malloc(bytes);
+static void *bump_chunk(mm_bump_t *bump, size_t size, bool current) {
 
-  /* If malloc() fails, skip zeroing out the memory. */
-  if (new_ptr)
-    memset(new_ptr, 0, bytes);
+  char *chunk = malloc(BUMP_CHUNK_HEADER + size);
 
-  return new_ptr;
+  if (!chunk) {
+    return NULL;
+  }
+
+  if (current || !bump->chunks) {
+    PUTP(chunk, bump->chunks);
+    bump->chunks = chunk;
+  } else {
+    PUTP(chunk, GETP(bump->chunks));
+    PUTP(bump->chunks, chunk);
+  }
+
+  return chunk + BUMP_CHUNK_HEADER;
+}
+
+/*
+ * mm_arena_alloc - Allocate size bytes from the bump arena by bumping the
+ * pointer of its current chunk. A new chunk is taken when the request does not
+ * fit, and requests bigger than half a chunk get a chunk of their own.
+ */
+void *mm_arena_alloc(mm_bump_t *bump, size_t size) {
+
+  /* rounding sizes this close to SIZE_MAX, or adding the chunk header to them,
+   * would wrap */
+  if (size > SIZE_MAX - ALIGNMENT - BUMP_CHUNK_HEADER) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size = size ? ROUND(size) : ALIGNMENT;
+
+  if ((size_t)(bump->end - bump->ptr) >= size) {
+    void *ptr = bump->ptr;
+
+    bump->ptr += size;
+    return ptr;
+  }
+
+  if (size > bump->chunk_size / 2) {
+    return bump_chunk(bump, size, false);
+  }
+
+  char *chunk = bump_chunk(bump, bump->chunk_size, true);
+
+  if (!chunk) {
+    return NULL;
+  }
+
+  bump->ptr = chunk + size;
+  bump->end = chunk + bump->chunk_size;
+
+  return chunk;
+}
+
+/*
+ * mm_arena_reset - Free everything allocated from the bump arena at once. Its
+ * chunks but the current one go back to the heap together, so adjacent ones
+ * are coalesced as a single block, and the current one is reused from its
+ * start.
+ */
+void mm_arena_reset(mm_bump_t *bump) {
+
+  void *chunks[BUMP_FREE_BATCH];
+  char *kept = bump->end ? bump->chunks : NULL;
+  char *chunk = kept ? GETP(kept) : bump->chunks;
+
+  while (chunk) {
+    int n = 0;
+
+    for (; chunk && n < BUMP_FREE_BATCH; chunk = GETP(chunk)) {
+      chunks[n++] = chunk;
+    }
+    mm_free_batch(chunks, n);
+  }
+
+  bump->chunks = kept;
+
+  if (kept) {
+    PUTP(kept, NULL);
+    bump->ptr = kept + BUMP_CHUNK_HEADER;
+  }
+}
+
+/*
+ * mm_arena_destroy - Free everything allocated from the bump arena and the
+ * arena itself
+ */
+void mm_arena_destroy(mm_bump_t *bump) {
+
+  if (bump) {
+    mm_arena_reset(bump);
+    free(bump->chunks);
+    free(bump);
+  }
+}
+
+/*
+ * mm_mallopt - Set a parameter of the allocator. Returns 1 on success and 0 if
+ * the parameter or its value is invalid.
+ */
+int mm_mallopt(int param, int value) {
+
+  switch (param) {
+    case MM_MMAP_THRESHOLD:
+      if (value <= 0) {
+        return 0;
+      }
+      mmap_threshold = value;
+      return 1;
+    case MM_TRIM_THRESHOLD:
+      if (value <= 0) {
+        return 0;
+      }
+      trim_threshold = value;
+      return 1;
+    case MM_CHUNK_SIZE:
+      /* regions of new arenas must start at page boundaries */
+      if (value < PAGE_SIZE || (value & (value - 1))) {
+        return 0;
+      }
+      chunk_size = value;
+      /* the biggest chunk is raised along, so the bounds stay ordered */
+      if (chunk_max < chunk_size) {
+        chunk_max = chunk_size;
+      }
+      return 1;
+    case MM_CHUNK_MAX:
+      if (value < PAGE_SIZE || (value & (value - 1)) ||
+          (size_t)value < chunk_size) {
+        return 0;
+      }
+      chunk_max = value;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * mm_get_classes - Read the layout of the size classes. Stores the number of
+ * singular classes and the biggest request of every ranged class but the last
+ * one, and returns the number of the latter.
+ */
+int mm_get_classes(int *singular, size_t *limits) {
+
+  pthread_once(&class_table_once, class_table_init);
+
+  *singular = singular_num;
+
+  for (int i = singular_num; i < class_num - 1; ++i) {
+    *limits++ = class_limits[i] - WSIZE;
+  }
+
+  return class_num - 1 - singular_num;
+}
+
+/*
+ * mm_set_classes - Set the layout of the size classes: singular classes of
+ * blocks of one size, ranged classes of the requests up to the given limits
+ * and one class of all bigger requests. Limits are rounded up to the sizes the
+ * class table tells apart, and the ones which fall into the previous class are
+ * dropped. It may only be called before mm_init, when no block is allocated.
+ * Returns 1 on success and 0 if the layout does not fit the free lists.
+ */
+int mm_set_classes(int singular, const size_t *limits, int num) {
+
+  if (singular < MIN_SINGULAR_NUM || singular > SINGULAR_BLOCKS_NUM ||
+      num < 0 || singular + num + 1 > SFL_SIZE) {
+    return 0;
+  }
+
+  /* the default table is not built later over this one */
+  pthread_once(&class_table_once, class_table_init);
+
+  singular_num = singular;
+  class_num = singular;
+
+  for (int i = 0; i < num; ++i) {
+    size_t limit = class_round(BLOCK_SIZE(limits[i]));
+    size_t prev = class_num > singular_num ? class_limits[class_num - 1]
+                                           : (size_t)singular * ALIGNMENT;
+
+    if (limits[i] < MAX_HEAP && limit > prev) {
+      class_limits[class_num++] = limit;
+    }
+  }
+
+  class_limits[class_num++] = SIZE_MAX;
+
+  class_table_fill();
+
+  return 1;
+}
+
+/*
+ * release_pages - Give back the pages inside a free block, leaving its fields
+ * and footer. Returns 1 if any page was released.
+ */
+static int release_pages(void *ptr) {
+
+  uintptr_t lo = ROUND_PAGE((uintptr_t)ptr + FREE_FIELDS_SIZE);
+  uintptr_t hi = (uintptr_t)FTRP(ptr) & -PAGE_SIZE;
+
+  if (hi <= lo) {
+    return 0;
+  }
+
+  mem_release((void *)lo, hi - lo);
+  return 1;
+}
+
+/*
+ * mm_trim - Give back the pages inside free blocks of the ranged size classes
+ * of every arena. Returns 1 if any page was released.
+ */
+int mm_trim(void) {
+
+  int released = 0;
+
+  for (int a = 0; a < arena_count; ++a) {
+
+    arena_t *ar = &arenas[a];
+
+    lock(&ar->lock);
+    quick_release(ar);
+
+    for (int i = singular_num; i < class_num; ++i) {
+      void *node = GETP(ADD_VOIDP(ar->sfl, i));
+
+      for (node = IS_TREE(i) ? tree_first(node) : node; node;
+           node = IS_TREE(i) ? tree_next(node) : NULL) {
+        for (void *ptr = node; ptr; ptr = NEXT_FREE_BLKP(ptr)) {
+          released |= release_pages(ptr);
+        }
+      }
+    }
+
+    if (WILDERNESS(ar)) {
+      released |= release_pages(WILDERNESS(ar));
+    }
+
+    unlock(&ar->lock);
+  }
+
+  return released;
 }
 
 /*
@@ -602,39 +3295,88 @@ void mm_checkheap(int verbose) {
   check_num++;
   printf("----- checking ----- %d\n", check_num);
 
-  char *blk_check = heap_start + DSIZE;
-  int blk_num = 0;
+  for (int a = 0; a < arena_count; ++a) {
+
+    arena_t *ar = &arenas[a];
+
+    lock(&ar->lock);
+
+    if (verbose > 0) {
+      printf("--- Arena %d ---\n", a);
 
-  if (verbose > 0) {
-    printf("Heap start offset: %p\n", heap_start + WSIZE);
+      for (char *region = ar->last_region; region; region = GETP(region)) {
 
-    while (blk_check < epilogue_blkp) {
+        char *blk_check = region + REGION_OVERHEAD;
+        int blk_num = 0;
 
-      printf("block number: %d size: %u ", blk_num, GET_SIZE(HDRP(blk_check)));
-      printf("alloc: %d pfree: %d address: %p\n", GET_ALLOC(HDRP(blk_check)),
-             GET_PFREE(HDRP(blk_check)), blk_check);
-      blk_num++;
-      blk_check = NEXT_BLKP(blk_check);
+        printf("Region start: %p\n", region);
+
+        while (GET_SIZE(HDRP(blk_check))) {
+
+          printf("block number: %d size: %lu ", blk_num,
+                 (unsigned long)GET_SIZE(HDRP(blk_check)));
+          printf("alloc: %d pfree: %d address: %p\n",
+                 (int)GET_ALLOC(HDRP(blk_check)),
+                 (int)GET_PFREE(HDRP(blk_check)), blk_check);
+          blk_num++;
+          blk_check = NEXT_BLKP(blk_check);
+        }
+
+        printf("Epilogue header: %p alloc: %d pfree: %d\n", HDRP(blk_check),
+               (int)GET_ALLOC(HDRP(blk_check)),
+               (int)GET_PFREE(HDRP(blk_check)));
+      }
     }
 
-    printf("Epilogue header: %p alloc: %d pfree: %d\n", epilogue_blkp,
-           GET_ALLOC(epilogue_blkp), GET_PFREE(epilogue_blkp));
-  }
+    if (verbose > 1) { // checking the segregated fit lists
+
+      printf("--- Segregated free lists ---\n");
+
+      for (int i = 0; i < SFL_SIZE; ++i) {
+
+        void *node = GETP(ADD_VOIDP(ar->sfl, i));
 
-  if (verbose > 1) { // checking the segregated fit lists
+        if (IS_TREE(i)) {
+          node = tree_first(node);
+        }
 
-    printf("--- Segregated free lists ---\n");
+        for (; node; node = IS_TREE(i) ? tree_next(node) : NULL) {
 
-    for (int i = 0; i < SFL_SIZE; ++i) {
+          void *ptr = node;
 
-      void *ptr = GETP(ADD_VOIDP(sfl_start, i));
+          while (ptr) {
+            printf("address: %p\n", ptr);
+            printf("size: %lu\n", (unsigned long)GET_SIZE(HDRP(ptr)));
 
-      while (ptr) {
-        printf("address: %p\n", ptr);
-        printf("size: %d\n", GET_SIZE(HDRP(ptr)));
+            ptr = NEXT_FREE_BLKP(ptr);
+          }
+        }
+      }
+    }
+
+    if (verbose > 1) { // checking the runs with free slots
+
+      printf("--- Runs ---\n");
 
-        ptr = NEXT_FREE_BLKP(ptr);
+      for (int i = 0; i < RUN_CLASSES; ++i) {
+        for (run_t *run = ar->runs[i]; run; run = run->next) {
+          printf("run: %p slot size: %d free slots: %d\n", (void *)run,
+                 run->slot_size, run->free_slots);
+        }
+      }
+
+      if (DEFER_COALESCING) {
+        printf("--- Quick lists ---\n");
+
+        for (int i = 0; i < SINGULAR_BLOCKS_NUM; ++i) {
+          for (void *ptr = ar->quick[i]; ptr; ptr = GETP(ptr)) {
+            printf("address: %p size: %lu\n", ptr,
+                   (unsigned long)GET_SIZE(HDRP(ptr)));
+          }
+        }
       }
     }
+
+    unlock(&ar->lock);
   }
 }
@@ -7,6 +7,10 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
 
 #else
 
@@ -15,11 +19,59 @@ extern void *malloc(size_t size);
 extern void free(void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
+extern void *memalign(size_t align, size_t size);
+extern int posix_memalign(void **memptr, size_t align, size_t size);
+extern void *aligned_alloc(size_t align, size_t size);
+extern size_t malloc_usable_size(void *ptr);
 
 #endif
 
 extern int mm_init(void);
 
+/* Parameters of mm_mallopt */
+#define MM_MMAP_THRESHOLD 1 /* Size of requests served by mapped regions */
+#define MM_TRIM_THRESHOLD 2 /* Size of free top of the heap to give back */
+/* Smallest size the heap grows by, a power of 2; raises the biggest one to it */
+#define MM_CHUNK_SIZE 3
+/* Biggest size the heap grows by, a power of 2, not below the smallest one */
+#define MM_CHUNK_MAX 4
+
+extern int mm_mallopt(int param, int value);
+
+/* Layout of size classes: the number of singular classes of blocks of one
+   size and the biggest request of every ranged class but the last, which
+   takes all bigger requests.  There are at most MM_CLASSES_MAX classes. */
+#define MM_CLASSES_MAX 64
+
+extern int mm_get_classes(int *singular, size_t *limits);
+extern int mm_set_classes(int singular, const size_t *limits, int num);
+
+/* Free a block given its requested size, or any size up to the usable one.
+   Only blocks too big for runs are freed faster than by free. */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/* Allocate n blocks of one size at once, returns the number allocated */
+extern int mm_malloc_batch(size_t size, int n, void **ptrs);
+
+/* Free n blocks at once; ptrs is sorted by address */
+extern void mm_free_batch(void **ptrs, int n);
+
+/* Bump arenas: blocks are bump allocated from chunks of the heap and all of
+   them are freed at once by mm_arena_reset or mm_arena_destroy.  A bump arena
+   must not be used by more threads at once. */
+typedef struct mm_bump mm_bump_t;
+
+extern mm_bump_t *mm_arena_create(size_t chunk_size);
+extern void *mm_arena_alloc(mm_bump_t *bump, size_t size);
+extern void mm_arena_reset(mm_bump_t *bump);
+extern void mm_arena_destroy(mm_bump_t *bump);
+
+/* Number of bytes which can be written to an allocated block */
+extern size_t mm_usable_size(void *ptr);
+
+/* Give back pages of large free blocks, returns 1 if any were released */
+extern int mm_trim(void);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);